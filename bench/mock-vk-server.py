@@ -0,0 +1,520 @@
+#!/usr/bin/env python3
+
+# A local stand-in for api.vk.com and the Long Poll server, which serves synthetic fixtures or replays
+# captured Long Poll responses. It is used together with vk-bench for measuring the plugin without access
+# to Vk.com, see README.txt.
+
+import argparse
+import json
+import random
+import sys
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+SELF_USER_ID = 1
+FIRST_FRIEND_ID = 100
+
+# Flag of unread messages in Long Poll events.
+MESSAGE_FLAG_UNREAD = 1
+
+# The smallest valid PNG image (1x1, transparent), served for all photos.
+PNG_1X1 = bytes.fromhex('89504e470d0a1a0a0000000d4948445200000001000000010806000000'
+                        '1f15c4890000000d49444154789c6360000002000154a24f5d0000000049454e44ae426082')
+
+
+class ApiError(Exception):
+    def __init__(self, code, msg):
+        Exception.__init__(self, msg)
+        self.code = code
+        self.msg = msg
+
+
+class Recording:
+    """Responses, captured by the plugin into VKCOM_CAPTURE_FILE. Each line is milliseconds since login,
+    source ("longpoll" or "api:<method>") and the response, separated by tabs."""
+
+    def __init__(self, path):
+        # Non-empty lists of updates from Long Poll responses in the order of receiving.
+        self.long_poll = []
+        # Message and user objects from all API responses by id.
+        self.messages = {}
+        self.users = {}
+        with open(path, encoding='utf-8') as f:
+            for line in f:
+                parts = line.rstrip('\n').split('\t', 2)
+                if len(parts) != 3:
+                    continue
+                try:
+                    response = json.loads(parts[2])
+                except ValueError:
+                    continue
+                if parts[1] == 'longpoll':
+                    if isinstance(response, dict) and 'failed' not in response and response.get('updates'):
+                        self.long_poll.append(response['updates'])
+                else:
+                    self.collect(response)
+
+    def collect(self, value):
+        if isinstance(value, list):
+            for v in value:
+                self.collect(v)
+        elif isinstance(value, dict):
+            if 'id' in value and 'date' in value and 'body' in value and 'out' in value:
+                self.messages[value['id']] = value
+            elif 'id' in value and 'first_name' in value:
+                self.users[value['id']] = value
+            for v in value.values():
+                self.collect(v)
+
+    def min_message_id(self):
+        """Returns the smallest id of the recorded messages and new message events or None."""
+        ids = list(self.messages)
+        for updates in self.long_poll:
+            ids += [u[1] for u in updates if isinstance(u, list) and len(u) > 1 and u[0] == 4]
+        return min(ids) if ids else None
+
+
+class Fixtures:
+    """Synthetic account: friends, dialogs with users and chats and the message history. Messages and
+    users from the recording, if any, are returned by messages.getById and users.get."""
+
+    def __init__(self, args, base_url, recording):
+        self.base_url = base_url
+        self.recording = recording
+        self.rand = random.Random(args.seed)
+        self.friend_ids = list(range(FIRST_FRIEND_ID, FIRST_FRIEND_ID + args.friends))
+        # A quarter of dialogs are with users, which are not friends.
+        self.dialog_user_ids = [FIRST_FRIEND_ID + i * 4 // 3 for i in range(max(args.dialogs - args.chats, 0))]
+        self.chat_ids = list(range(1, args.chats + 1))
+        self.lock = threading.Lock()
+
+        # All the messages by id. Ids increase by one for each message, both incoming and outgoing.
+        self.messages = {}
+        self.last_msg_id = 0
+        peers = [(user_id, 0) for user_id in self.dialog_user_ids] + [(0, chat_id) for chat_id in self.chat_ids]
+        backlog = args.backlog
+        if recording and recording.min_message_id() is not None:
+            # The history must precede the replayed messages, otherwise the plugin ignores them
+            # as already received.
+            backlog = max(min(backlog, recording.min_message_id() - 1), 0)
+        start_time = int(time.time()) - backlog * 60
+        for i in range(backlog):
+            user_id, chat_id = self.rand.choice(peers) if peers else (self.random_friend(), 0)
+            out = self.rand.random() < 0.3
+            unread = not out and i >= backlog - args.unread
+            self.add_message(user_id, chat_id, out, unread, start_time + i * 60,
+                             with_photo=self.rand.random() < args.photo_share)
+
+    def random_friend(self):
+        if not self.friend_ids:
+            return FIRST_FRIEND_ID
+        return self.rand.choice(self.friend_ids)
+
+    def add_message(self, user_id, chat_id, out, unread, date, with_photo=False, text=None):
+        with self.lock:
+            self.last_msg_id += 1
+            msg_id = self.last_msg_id
+            if chat_id != 0:
+                user_id = SELF_USER_ID if out else self.chat_users(chat_id)[1 + msg_id % 4]
+            message = {
+                'id': msg_id,
+                'user_id': user_id,
+                'date': date,
+                'read_state': 0 if unread else 1,
+                'out': 1 if out else 0,
+                'body': text if text is not None else 'Message %d' % msg_id,
+            }
+            if chat_id != 0:
+                message['chat_id'] = chat_id
+                message['title'] = self.chat_title(chat_id)
+                message['chat_active'] = self.chat_users(chat_id)
+                message['admin_id'] = SELF_USER_ID
+            if with_photo:
+                message['attachments'] = [{'type': 'photo', 'photo': {
+                    'id': msg_id, 'owner_id': user_id, 'text': '',
+                    'photo_130': self.photo_url('p%d' % msg_id),
+                    'photo_604': self.photo_url('p%d' % msg_id)}}]
+            self.messages[msg_id] = message
+            return message
+
+    def photo_url(self, name):
+        return '%s/img/%s.png' % (self.base_url, name)
+
+    def chat_title(self, chat_id):
+        return 'Chat %d' % chat_id
+
+    def chat_users(self, chat_id):
+        return [SELF_USER_ID] + [FIRST_FRIEND_ID + (chat_id * 7 + i) % max(len(self.friend_ids), 1)
+                                 for i in range(4)]
+
+    def user(self, user_id, fields):
+        if self.recording and user_id in self.recording.users:
+            return self.recording.users[user_id]
+        user = {'id': user_id, 'first_name': 'First%d' % user_id, 'last_name': 'Last%d' % user_id}
+        if 'photo_50' in fields:
+            user['photo_50'] = self.photo_url('u%d' % user_id)
+        if 'photo_max_orig' in fields:
+            user['photo_max_orig'] = self.photo_url('u%d_max' % user_id)
+        if 'domain' in fields:
+            user['domain'] = 'user%d' % user_id
+        if 'online' in fields:
+            user['online'] = 1 if user_id % 10 == 0 else 0
+        if 'last_seen' in fields:
+            user['last_seen'] = {'time': int(time.time()) - user_id % 3600, 'platform': 7}
+        return user
+
+    # API methods. Each takes the dict of parameters and returns the response.
+
+    def friends_get(self, params):
+        fields = params.get('fields', '')
+        return {'count': len(self.friend_ids), 'items': [self.user(i, fields) for i in self.friend_ids]}
+
+    def friends_getOnline(self, params):
+        online = [i for i in self.friend_ids if i % 10 == 0]
+        online_mobile = [i for i in self.friend_ids if i % 10 == 5]
+        return {'online': online, 'online_mobile': online_mobile}
+
+    def users_get(self, params):
+        ids = split_ids(params.get('user_ids', '')) or [SELF_USER_ID]
+        return [self.user(i, params.get('fields', '')) for i in ids]
+
+    def groups_getById(self, params):
+        return [{'id': i, 'name': 'Group %d' % i, 'screen_name': 'club%d' % i, 'type': 'group'}
+                for i in split_ids(params.get('group_ids', ''))]
+
+    def messages_getDialogs(self, params):
+        count = int(params.get('count', '20'))
+        offset = int(params.get('offset', '0'))
+        # The newest message of each dialog, dialogs are sorted by the newest message.
+        with self.lock:
+            newest = {}
+            for message in self.messages.values():
+                newest[(message.get('chat_id', 0), message['user_id'] if 'chat_id' not in message else 0)] = message
+            for chat_id in self.chat_ids:
+                if (chat_id, 0) not in newest:
+                    newest[(chat_id, 0)] = {'id': 0, 'user_id': SELF_USER_ID, 'chat_id': chat_id, 'date': 0,
+                                            'read_state': 1, 'out': 1, 'body': '',
+                                            'title': self.chat_title(chat_id),
+                                            'chat_active': self.chat_users(chat_id), 'admin_id': SELF_USER_ID}
+            dialogs = sorted(newest.values(), key=lambda m: m['id'], reverse=True)
+        return {'count': len(dialogs), 'items': [{'message': m} for m in dialogs[offset:offset + count]]}
+
+    def messages_getChat(self, params):
+        fields = params.get('fields', '')
+        chat_ids = split_ids(params.get('chat_ids', params.get('chat_id', '')))
+        return [{'id': chat_id, 'type': 'chat', 'title': self.chat_title(chat_id), 'admin_id': SELF_USER_ID,
+                 'users': [self.user(i, fields) for i in self.chat_users(chat_id)]} for chat_id in chat_ids]
+
+    def messages_get(self, params):
+        out = params.get('out', '0') == '1'
+        count = int(params.get('count', '20'))
+        offset = int(params.get('offset', '0'))
+        last_message_id = int(params.get('last_message_id', '0'))
+        with self.lock:
+            ids = sorted((i for i, m in self.messages.items() if m['out'] == out), reverse=True)
+            items = [self.messages[i] for i in ids if i > last_message_id][offset:offset + count]
+        return {'count': len(ids), 'items': items}
+
+    def messages_getById(self, params):
+        recorded = self.recording.messages if self.recording else {}
+        with self.lock:
+            items = [self.messages[i] if i in self.messages else recorded[i]
+                     for i in split_ids(params.get('message_ids', '')) if i in self.messages or i in recorded]
+        return {'count': len(items), 'items': items}
+
+    def messages_send(self, params):
+        peer = int(params.get('user_id', '0'))
+        chat_id = int(params.get('chat_id', '0'))
+        return self.add_message(peer, chat_id, True, False, int(time.time()), text=params.get('message', ''))['id']
+
+    def messages_getLongPollServer(self, params):
+        return {'key': 'mockkey', 'server': '%s/longpoll' % self.base_url, 'ts': self.long_poll.ts,
+                'pts': self.long_poll.ts}
+
+    def messages_getLongPollHistory(self, params):
+        # Events are not kept, so the client receives messages by id range instead.
+        return {'history': [], 'messages': {'count': 0, 'items': []}, 'more': 1}
+
+    def docs_get(self, params):
+        return {'count': 0, 'items': []}
+
+    def photos_getMessagesUploadServer(self, params):
+        return {'upload_url': '%s/upload/photo' % self.base_url}
+
+    def photos_saveMessagesPhoto(self, params):
+        return [{'id': 1, 'owner_id': SELF_USER_ID}]
+
+    def docs_getWallUploadServer(self, params):
+        return {'upload_url': '%s/upload/doc' % self.base_url}
+
+    def docs_save(self, params):
+        return [{'id': 1, 'owner_id': SELF_USER_ID, 'title': 'doc', 'size': 1, 'url': self.base_url + '/doc/1'}]
+
+    def utils_resolveScreenName(self, params):
+        return []
+
+    def call(self, method, params):
+        if method in ('account.setOnline', 'account.setOffline', 'status.set', 'messages.markAsRead',
+                      'messages.setActivity', 'messages.addChatUser', 'messages.removeChatUser',
+                      'messages.editChat'):
+            return 1
+        handler = getattr(self, method.replace('.', '_'), None)
+        if handler is None:
+            raise ApiError(3, 'Unknown method passed')
+        return handler(params)
+
+
+class LongPoll:
+    """Stream of Long Poll events: either the recorded responses, replayed one by one, or synthetic
+    new messages and online/offline changes."""
+
+    def __init__(self, args, fixtures, recording):
+        self.fixtures = fixtures
+        self.events_left = args.events
+        self.events_per_response = args.events_per_response
+        self.replayed = list(reversed(recording.long_poll)) if recording else None
+        self.ts = 1
+        self.stats = StreamStats('Long Poll replay' if recording else 'Long Poll')
+
+    def response(self, ts, wait):
+        if self.replayed is not None:
+            return self.replay_response(wait)
+        if self.events_left <= 0:
+            self.stats.finish()
+            time.sleep(wait)
+            return {'ts': self.ts, 'updates': []}
+
+        self.stats.start()
+        updates = []
+        for _ in range(min(self.events_per_response, self.events_left)):
+            updates.append(self.event())
+        self.events_left -= len(updates)
+        self.ts += 1
+        self.stats.add(len(updates))
+        return {'ts': self.ts, 'updates': updates}
+
+    def replay_response(self, wait):
+        if not self.replayed:
+            self.stats.finish()
+            time.sleep(wait)
+            return {'ts': self.ts, 'updates': []}
+
+        self.stats.start()
+        updates = self.replayed.pop()
+        self.ts += 1
+        self.stats.add(len(updates))
+        return {'ts': self.ts, 'updates': updates}
+
+    def event(self):
+        fixtures = self.fixtures
+        user_id = fixtures.random_friend()
+        kind = fixtures.rand.random()
+        if kind < 0.2:
+            return [8, -user_id, 7]
+        if kind < 0.4:
+            return [9, -user_id, 0]
+        message = fixtures.add_message(user_id, 0, False, True, int(time.time()))
+        return [4, message['id'], MESSAGE_FLAG_UNREAD, user_id, message['date'], ' ... ', message['body'], {}]
+
+
+class StreamStats:
+    """Counts events, served as fast as the client requests them, and prints the rate once done."""
+
+    def __init__(self, name):
+        self.name = name
+        self.responses = 0
+        self.events = 0
+        self.start_time = None
+        self.printed = False
+
+    def start(self):
+        if self.start_time is None:
+            self.start_time = time.time()
+
+    def add(self, events):
+        self.responses += 1
+        self.events += events
+
+    def finish(self):
+        if self.printed or self.start_time is None:
+            return
+        self.printed = True
+        elapsed = max(time.time() - self.start_time, 1e-6)
+        log('%s: %d events in %d responses in %.2fs, %.0f events/s'
+            % (self.name, self.events, self.responses, elapsed, self.events / elapsed))
+
+
+def split_ids(s):
+    return [int(i) for i in s.split(',') if i.strip()]
+
+
+def log(text):
+    sys.stderr.write('mock-vk-server: %s\n' % text)
+    sys.stderr.flush()
+
+
+def call_api(fixtures, method, params):
+    """Returns the response object for the API call, like api.vk.com does."""
+    try:
+        if method == 'execute':
+            return execute(fixtures, params.get('code', ''))
+        return {'response': fixtures.call(method, params)}
+    except ApiError as e:
+        return {'error': {'error_code': e.code, 'error_msg': e.msg, 'request_params': []}}
+
+
+def execute(fixtures, code):
+    """Runs VKScript of the form "return [API.method({...}).field[0], ...];", which is the only form
+    the plugin sends (see send_batch and get_last_message_id)."""
+    decoder = json.JSONDecoder()
+    results = []
+    errors = []
+    pos = code.find('API.')
+    while pos >= 0:
+        open_pos = code.index('(', pos)
+        method = code[pos + 4:open_pos]
+        args, end = decoder.raw_decode(code, open_pos + 1)
+        end = code.index(')', end) + 1
+        # Accessors like .items[0].id after the call.
+        accessors = []
+        while end < len(code) and code[end] in '.[' and not code.startswith('.API', end):
+            if code[end] == '.':
+                name_end = end + 1
+                while name_end < len(code) and (code[name_end].isalnum() or code[name_end] == '_'):
+                    name_end += 1
+                accessors.append(code[end + 1:name_end])
+                end = name_end
+            else:
+                close = code.index(']', end)
+                accessors.append(int(code[end + 1:close]))
+                end = close + 1
+
+        try:
+            result = fixtures.call(method, {k: str(v) for k, v in args.items()})
+            for a in accessors:
+                try:
+                    result = result[a]
+                except (KeyError, IndexError, TypeError):
+                    result = None
+                    break
+            results.append(result)
+        except ApiError as e:
+            results.append(False)
+            errors.append({'method': method, 'error_code': e.code, 'error_msg': e.msg})
+        pos = code.find('API.', end)
+
+    response = {'response': results}
+    if errors:
+        response['execute_errors'] = errors
+    return response
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            BaseHTTPRequestHandler.log_message(self, format, *args)
+
+    def send_body(self, body, content_type='application/json; charset=utf-8'):
+        self.send_response(200)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_json(self, value):
+        self.send_body(json.dumps(value, ensure_ascii=False).encode('utf-8'))
+
+    def do_GET(self):
+        self.handle_request({})
+
+    def do_POST(self):
+        length = int(self.headers.get('Content-Length', '0'))
+        body = self.rfile.read(length)
+        params = {}
+        if self.headers.get('Content-Type', '').startswith('application/x-www-form-urlencoded'):
+            params = dict(urllib.parse.parse_qsl(body.decode('utf-8'), keep_blank_values=True))
+        self.handle_request(params)
+
+    def handle_request(self, params):
+        server = self.server
+        url = urllib.parse.urlsplit(self.path)
+        params.update(urllib.parse.parse_qsl(url.query, keep_blank_values=True))
+        if url.path.startswith('/method/'):
+            method = url.path[len('/method/'):]
+            server.count_call(method)
+            self.send_json(call_api(server.fixtures, method, params))
+        elif url.path == '/longpoll':
+            wait = min(int(params.get('wait', '25')), 90)
+            self.send_json(server.long_poll.response(int(params.get('ts', '0')), wait))
+        elif url.path.startswith('/img/'):
+            self.send_body(PNG_1X1, 'image/png')
+        elif url.path == '/upload/photo':
+            self.send_json({'server': 1, 'photo': '[]', 'hash': 'mock'})
+        elif url.path == '/upload/doc':
+            self.send_json({'file': 'mock'})
+        else:
+            self.send_error(404)
+
+
+class MockServer(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, address, args):
+        ThreadingHTTPServer.__init__(self, address, Handler)
+        self.verbose = args.verbose
+        base_url = 'http://%s:%d' % (args.host, self.server_address[1])
+        recording = Recording(args.replay) if args.replay else None
+        if recording:
+            log('replaying %d Long Poll responses, %d messages and %d users from %s'
+                % (len(recording.long_poll), len(recording.messages), len(recording.users), args.replay))
+        self.fixtures = Fixtures(args, base_url, recording)
+        self.long_poll = LongPoll(args, self.fixtures, recording)
+        self.fixtures.long_poll = self.long_poll
+        self.calls = {}
+        self.calls_lock = threading.Lock()
+
+    def count_call(self, method):
+        with self.calls_lock:
+            self.calls[method] = self.calls.get(method, 0) + 1
+
+    def print_calls(self):
+        with self.calls_lock:
+            for method, count in sorted(self.calls.items()):
+                log('%s: %d calls' % (method, count))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Local stand-in for api.vk.com and Long Poll server.')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--friends', type=int, default=100, help='number of friends')
+    parser.add_argument('--dialogs', type=int, default=50, help='number of dialogs, including chats')
+    parser.add_argument('--chats', type=int, default=5, help='number of chats')
+    parser.add_argument('--backlog', type=int, default=1000, help='number of messages in history')
+    parser.add_argument('--unread', type=int, default=20, help='number of unread messages in history')
+    parser.add_argument('--photo-share', type=float, default=0.1,
+                        help='share of messages with a photo attachment')
+    parser.add_argument('--events', type=int, default=0, help='number of Long Poll events to send')
+    parser.add_argument('--events-per-response', type=int, default=50)
+    parser.add_argument('--replay', metavar='CAPTURE_FILE',
+                        help='replay Long Poll responses, captured with VKCOM_CAPTURE_FILE, instead of '
+                             'synthetic events')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--verbose', action='store_true', help='log every request')
+    args = parser.parse_args()
+
+    server = MockServer((args.host, args.port), args)
+    log('listening on http://%s:%d' % (args.host, server.server_address[1]))
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    server.print_calls()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,363 @@
+// Headless benchmark driver: loads the plugin into a minimal libpurple core, connects to the local
+// mock server (see mock-vk-server.py) and reports login timings, API call counts, per-stage processing
+// times, allocations and peak memory usage. See README.txt for usage.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/resource.h>
+
+#include <glib.h>
+
+#include <account.h>
+#include <blist.h>
+#include <cmds.h>
+#include <connection.h>
+#include <conversation.h>
+#include <core.h>
+#include <debug.h>
+#include <eventloop.h>
+#include <plugin.h>
+#include <prefs.h>
+#include <savedstatuses.h>
+#include <signals.h>
+#include <util.h>
+
+using std::string;
+
+#ifdef __GLIBC__
+
+// Counters of heap allocations in the whole process (libpurple, glib and the plugin). glibc lets
+// the executable replace malloc and friends, the originals are available as __libc_* functions.
+std::atomic<unsigned long long> allocation_count(0);
+std::atomic<unsigned long long> allocated_bytes(0);
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) throw()
+{
+    allocation_count++;
+    allocated_bytes += size;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) throw()
+{
+    allocation_count++;
+    allocated_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) throw()
+{
+    allocation_count++;
+    allocated_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+} // extern "C"
+
+#endif
+
+namespace
+{
+
+const char UI_ID[] = "vk-bench";
+const char PRPL_ID[] = "prpl-vkcom";
+// Must be the same as VK_PERMISSIONS in vk-common.cpp, otherwise the plugin ignores the stored token.
+const char VK_PERMISSIONS[] = "friends,photos,audio,video,docs,status,messages,offline";
+
+// Command line options.
+struct Options
+{
+    const char* plugin_dir;
+    const char* api_url;
+    // The stored id of the last received message, zero means the first login.
+    int last_msg_id;
+    // Time in seconds to keep running after the login has completed, so that Long Poll events
+    // get processed.
+    int linger;
+    // Time in seconds, after which the benchmark fails if the login has not completed.
+    int timeout;
+};
+
+// The state of the benchmark. Times are in microseconds since the start.
+struct Bench
+{
+    Options options;
+    GMainLoop* loop;
+    PurpleAccount* account;
+    gint64 start_time;
+    // Allocation counters upon the start.
+    unsigned long long start_allocation_count;
+    unsigned long long start_allocated_bytes;
+    gint64 connected_time;
+    gint64 blist_time;
+    gint64 history_time;
+    bool finishing;
+    bool failed;
+};
+
+Bench bench;
+
+gint64 elapsed()
+{
+    return g_get_monotonic_time() - bench.start_time;
+}
+
+// Glib-based event loop for libpurple, the same as in libpurple/example/nullclient.c.
+
+const GIOCondition PURPLE_GLIB_READ_COND = GIOCondition(G_IO_IN | G_IO_HUP | G_IO_ERR);
+const GIOCondition PURPLE_GLIB_WRITE_COND = GIOCondition(G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL);
+
+struct GlibIOClosure
+{
+    PurpleInputFunction function;
+    gpointer data;
+};
+
+gboolean glib_io_invoke(GIOChannel* source, GIOCondition condition, gpointer data)
+{
+    GlibIOClosure* closure = (GlibIOClosure*)data;
+    int purple_cond = 0;
+    if (condition & PURPLE_GLIB_READ_COND)
+        purple_cond |= PURPLE_INPUT_READ;
+    if (condition & PURPLE_GLIB_WRITE_COND)
+        purple_cond |= PURPLE_INPUT_WRITE;
+    closure->function(closure->data, g_io_channel_unix_get_fd(source), PurpleInputCondition(purple_cond));
+    return TRUE;
+}
+
+guint glib_input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function, gpointer data)
+{
+    GlibIOClosure* closure = g_new0(GlibIOClosure, 1);
+    closure->function = function;
+    closure->data = data;
+
+    int cond = 0;
+    if (condition & PURPLE_INPUT_READ)
+        cond |= PURPLE_GLIB_READ_COND;
+    if (condition & PURPLE_INPUT_WRITE)
+        cond |= PURPLE_GLIB_WRITE_COND;
+
+    GIOChannel* channel = g_io_channel_unix_new(fd);
+    guint result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, GIOCondition(cond), glib_io_invoke,
+                                       closure, g_free);
+    g_io_channel_unref(channel);
+    return result;
+}
+
+PurpleEventLoopUiOps eventloop_ui_ops;
+PurpleDebugUiOps debug_ui_ops;
+PurpleConversationUiOps conv_ui_ops;
+
+void finish();
+
+gboolean finish_cb(gpointer)
+{
+    finish();
+    return FALSE;
+}
+
+// Called once both the buddy list and the message history have been received.
+void login_completed()
+{
+    printf("Login completed in %.3fs, running for %ds more\n", elapsed() / 1e6, bench.options.linger);
+    g_timeout_add_seconds(bench.options.linger, finish_cb, nullptr);
+}
+
+// The plugin reports the completion of login stages only in the debug log.
+void debug_print(PurpleDebugLevel, const char* category, const char* arg_s)
+{
+    if (!category || strcmp(category, PRPL_ID) != 0 || bench.finishing)
+        return;
+
+    bool was_completed = bench.blist_time != 0 && bench.history_time != 0;
+    if (bench.blist_time == 0 && g_str_has_prefix(arg_s, "Users and chats information updated"))
+        bench.blist_time = elapsed();
+    if (bench.history_time == 0 && g_str_has_prefix(arg_s, "Finished receiving messages"))
+        bench.history_time = elapsed();
+    if (!was_completed && bench.blist_time != 0 && bench.history_time != 0)
+        login_completed();
+}
+
+gboolean debug_is_enabled(PurpleDebugLevel, const char*)
+{
+    return TRUE;
+}
+
+// Prints the output of /vkstats.
+void write_conv(PurpleConversation*, const char*, const char*, const char* message, PurpleMessageFlags,
+                time_t)
+{
+    char* text = purple_markup_strip_html(message);
+    printf("%s\n", text);
+    g_free(text);
+}
+
+void signed_on(PurpleConnection*, gpointer)
+{
+    bench.connected_time = elapsed();
+}
+
+void connection_error(PurpleConnection*, PurpleConnectionError, const gchar* description, gpointer)
+{
+    fprintf(stderr, "Connection error: %s\n", description);
+    bench.failed = true;
+    g_main_loop_quit(bench.loop);
+}
+
+gboolean timeout_cb(gpointer)
+{
+    if (bench.finishing)
+        return FALSE;
+
+    fprintf(stderr, "Login has not completed in %ds\n", bench.options.timeout);
+    bench.failed = true;
+    finish();
+    return FALSE;
+}
+
+void print_time(const char* name, gint64 time)
+{
+    if (time != 0)
+        printf("%s: %.3fs\n", name, time / 1e6);
+    else
+        printf("%s: not reached\n", name);
+}
+
+void finish()
+{
+    bench.finishing = true;
+
+    // API call counts and other statistics, collected by the plugin.
+    PurpleConversation* conv = purple_conversation_new(PURPLE_CONV_TYPE_IM, bench.account, "id1");
+    char* error = nullptr;
+    if (purple_cmd_do_command(conv, "vkstats", "vkstats", &error) != PURPLE_CMD_STATUS_OK)
+        fprintf(stderr, "Unable to run /vkstats: %s\n", error ? error : "unknown error");
+    g_free(error);
+    purple_conversation_destroy(conv);
+
+    print_time("Time to connected", bench.connected_time);
+    print_time("Time to buddy list complete", bench.blist_time);
+    print_time("Time to message history received", bench.history_time);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak RSS: %ld KB\n", usage.ru_maxrss);
+#ifdef __GLIBC__
+    printf("Allocations since login: %llu, %llu KB\n", allocation_count - bench.start_allocation_count,
+           (allocated_bytes - bench.start_allocated_bytes) / 1024);
+#endif
+
+    g_main_loop_quit(bench.loop);
+}
+
+bool parse_options(int argc, char** argv, Options& options)
+{
+    options.plugin_dir = nullptr;
+    options.api_url = "http://127.0.0.1:8080";
+    options.last_msg_id = 0;
+    options.linger = 5;
+    options.timeout = 120;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--plugin-dir") == 0)
+            options.plugin_dir = argv[i + 1];
+        else if (strcmp(argv[i], "--api-url") == 0)
+            options.api_url = argv[i + 1];
+        else if (strcmp(argv[i], "--last-msg-id") == 0)
+            options.last_msg_id = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--linger") == 0)
+            options.linger = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--timeout") == 0)
+            options.timeout = atoi(argv[i + 1]);
+        else
+            return false;
+    }
+    return argc % 2 == 1 && options.plugin_dir;
+}
+
+} // End of anonymous namespace
+
+int main(int argc, char** argv)
+{
+    if (!parse_options(argc, argv, bench.options)) {
+        fprintf(stderr, "Usage: %s --plugin-dir DIR [--api-url URL] [--last-msg-id ID] [--linger SECONDS]"
+                " [--timeout SECONDS]\n", argv[0]);
+        return 2;
+    }
+
+    // The plugin reads the URL upon the first API call.
+    g_setenv("VKCOM_API_URL", bench.options.api_url, TRUE);
+
+    // Each run starts with empty settings, logs and caches.
+    char* user_dir = g_dir_make_tmp("vk-bench-XXXXXX", nullptr);
+    purple_util_set_user_dir(user_dir);
+
+    eventloop_ui_ops.timeout_add = g_timeout_add;
+    eventloop_ui_ops.timeout_remove = g_source_remove;
+    eventloop_ui_ops.input_add = glib_input_add;
+    eventloop_ui_ops.input_remove = g_source_remove;
+    eventloop_ui_ops.timeout_add_seconds = g_timeout_add_seconds;
+    purple_eventloop_set_ui_ops(&eventloop_ui_ops);
+
+    purple_debug_set_enabled(FALSE);
+    debug_ui_ops.print = debug_print;
+    debug_ui_ops.is_enabled = debug_is_enabled;
+    purple_debug_set_ui_ops(&debug_ui_ops);
+
+    conv_ui_ops.write_conv = write_conv;
+    purple_conversations_set_ui_ops(&conv_ui_ops);
+
+    purple_plugins_add_search_path(bench.options.plugin_dir);
+    if (!purple_core_init(UI_ID)) {
+        fprintf(stderr, "Unable to initialize libpurple\n");
+        return 1;
+    }
+    purple_set_blist(purple_blist_new());
+    if (!purple_find_prpl(PRPL_ID)) {
+        fprintf(stderr, "Plugin %s has not been found in %s\n", PRPL_ID, bench.options.plugin_dir);
+        return 1;
+    }
+
+    static int handle;
+    purple_signal_connect(purple_connections_get_handle(), "signed-on", &handle,
+                          PURPLE_CALLBACK(signed_on), nullptr);
+    purple_signal_connect(purple_connections_get_handle(), "connection-error", &handle,
+                          PURPLE_CALLBACK(connection_error), nullptr);
+
+    // The stored token lets the plugin skip authentication at oauth.vk.com.
+    bench.account = purple_account_new("bench@example.com", PRPL_ID);
+    purple_account_set_password(bench.account, "password");
+    purple_account_set_string(bench.account, "access_token", "mock-token");
+    purple_account_set_string(bench.account, "access_token_permissions", VK_PERMISSIONS);
+    purple_account_set_string(bench.account, "self_user_id", "1");
+    purple_account_set_int(bench.account, "last_msg_id", bench.options.last_msg_id);
+    purple_accounts_add(bench.account);
+
+    bench.loop = g_main_loop_new(nullptr, FALSE);
+    bench.start_time = g_get_monotonic_time();
+#ifdef __GLIBC__
+    bench.start_allocation_count = allocation_count;
+    bench.start_allocated_bytes = allocated_bytes;
+#endif
+    purple_account_set_enabled(bench.account, UI_ID, TRUE);
+    purple_savedstatus_activate(purple_savedstatus_new(nullptr, PURPLE_STATUS_AVAILABLE));
+    g_timeout_add_seconds(bench.options.timeout, timeout_cb, nullptr);
+
+    g_main_loop_run(bench.loop);
+
+    purple_account_set_enabled(bench.account, UI_ID, FALSE);
+    purple_core_quit();
+    g_main_loop_unref(bench.loop);
+    g_free(user_dir);
+    return bench.failed ? 1 : 0;
+}
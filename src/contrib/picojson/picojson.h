@@ -56,6 +56,13 @@
 #include <string>
 #include <vector>
 
+#ifdef PICOJSON_USE_INT64
+#define __STDC_FORMAT_MACROS
+#include <cerrno>
+#include <inttypes.h>
+#include <limits>
+#endif
+
 #ifdef _MSC_VER
     #define SNPRINTF _snprintf_s
     #pragma warning(push)
@@ -73,6 +80,9 @@ namespace picojson {
     string_type,
     array_type,
     object_type
+#ifdef PICOJSON_USE_INT64
+    , int64_type
+#endif
   };
   
   struct null {};
@@ -84,6 +94,9 @@ namespace picojson {
     union _storage {
       bool boolean_;
       double number_;
+#ifdef PICOJSON_USE_INT64
+      int64_t int64_;
+#endif
       std::string* string_;
       array* array_;
       object* object_;
@@ -96,6 +109,9 @@ namespace picojson {
     value(int type, bool);
     explicit value(bool b);
     explicit value(double n);
+#ifdef PICOJSON_USE_INT64
+    explicit value(int64_t i);
+#endif
     explicit value(const std::string& s);
     explicit value(const array& a);
     explicit value(const object& o);
@@ -146,6 +162,12 @@ namespace picojson {
     u_.number_ = n;
   }
   
+#ifdef PICOJSON_USE_INT64
+  inline value::value(int64_t i) : type_(int64_type) {
+    u_.int64_ = i;
+  }
+#endif
+  
   inline value::value(const std::string& s) : type_(string_type) {
     u_.string_ = new std::string(s);
   }
@@ -209,12 +231,28 @@ namespace picojson {
   }
   IS(null, null)
   IS(bool, boolean)
-  IS(int, number)
-  IS(double, number)
+#ifdef PICOJSON_USE_INT64
+  IS(int64_t, int64)
+#endif
   IS(std::string, string)
   IS(array, array)
   IS(object, object)
 #undef IS
+  // Integers are numbers too.
+  template <> inline bool value::is<int>() const {
+    return type_ == number_type
+#ifdef PICOJSON_USE_INT64
+      || type_ == int64_type
+#endif
+      ;
+  }
+  template <> inline bool value::is<double>() const {
+    return type_ == number_type
+#ifdef PICOJSON_USE_INT64
+      || type_ == int64_type
+#endif
+      ;
+  }
   
 #define GET(ctype, var)						\
   template <> inline const ctype& value::get<ctype>() const {	\
@@ -228,7 +266,13 @@ namespace picojson {
     return var;							\
   }
   GET(bool, u_.boolean_)
+#ifdef PICOJSON_USE_INT64
+  // Integer values get converted to double in place upon request.
+  GET(double, (type_ == int64_type && ((const_cast<value*>(this)->type_ = number_type), (const_cast<value*>(this)->u_.number_ = u_.int64_)), u_.number_))
+  GET(int64_t, u_.int64_)
+#else
   GET(double, u_.number_)
+#endif
   GET(std::string, *u_.string_)
   GET(array, *u_.array_)
   GET(object, *u_.object_)
@@ -242,6 +286,10 @@ namespace picojson {
       return u_.boolean_;
     case number_type:
       return u_.number_ != 0;
+#ifdef PICOJSON_USE_INT64
+    case int64_type:
+      return u_.int64_ != 0;
+#endif
     case string_type:
       return ! u_.string_->empty();
     default:
@@ -307,6 +355,13 @@ namespace picojson {
       }
       return buf;
     }
+#ifdef PICOJSON_USE_INT64
+    case int64_type: {
+      char buf[sizeof("-9223372036854775808")];
+      SNPRINTF(buf, sizeof(buf), "%" PRId64, u_.int64_);
+      return buf;
+    }
+#endif
     case string_type:    return *u_.string_;
     case array_type:     return "array";
     case object_type:    return "object";
@@ -594,7 +649,7 @@ namespace picojson {
     return in.expect('}');
   }
   
-  template <typename Iter> inline bool _parse_number(double& out, input<Iter>& in) {
+  template <typename Iter> inline std::string _parse_number(input<Iter>& in) {
     std::string num_str;
     while (1) {
       int ch = in.getc();
@@ -610,9 +665,7 @@ namespace picojson {
 	break;
       }
     }
-    char* endp;
-    out = strtod(num_str.c_str(), &endp);
-    return endp == num_str.c_str() + num_str.size();
+    return num_str;
   }
   
   template <typename Context, typename Iter> inline bool _parse(Context& ctx, input<Iter>& in) {
@@ -638,13 +691,30 @@ namespace picojson {
     default:
       if (('0' <= ch && ch <= '9') || ch == '-') {
 	in.ungetc();
-	double f;
-	if (_parse_number(f, in)) {
+	std::string num_str = _parse_number(in);
+	if (num_str.empty()) {
+	  return false;
+	}
+	char* endp;
+#ifdef PICOJSON_USE_INT64
+	{
+	  errno = 0;
+	  intmax_t ival = strtoimax(num_str.c_str(), &endp, 10);
+	  if (errno == 0
+	      && std::numeric_limits<int64_t>::min() <= ival
+	      && ival <= std::numeric_limits<int64_t>::max()
+	      && endp == num_str.c_str() + num_str.size()) {
+	    ctx.set_int64(ival);
+	    return true;
+	  }
+	}
+#endif
+	double f = strtod(num_str.c_str(), &endp);
+	if (endp == num_str.c_str() + num_str.size()) {
 	  ctx.set_number(f);
 	  return true;
-	} else {
-	  return false;
 	}
+	return false;
       }
       break;
     }
@@ -657,6 +727,9 @@ namespace picojson {
     bool set_null() { return false; }
     bool set_bool(bool) { return false; }
     bool set_number(double) { return false; }
+#ifdef PICOJSON_USE_INT64
+    bool set_int64(int64_t) { return false; }
+#endif
     template <typename Iter> bool parse_string(input<Iter>&) { return false; }
     bool parse_array_start() { return false; }
     template <typename Iter> bool parse_array_item(input<Iter>&, size_t) {
@@ -685,6 +758,12 @@ namespace picojson {
       *out_ = value(f);
       return true;
     }
+#ifdef PICOJSON_USE_INT64
+    bool set_int64(int64_t i) {
+      *out_ = value(i);
+      return true;
+    }
+#endif
     template<typename Iter> bool parse_string(input<Iter>& in) {
       *out_ = value(string_type, false);
       return _parse_string(out_->get<std::string>(), in);
@@ -723,6 +802,9 @@ namespace picojson {
     bool set_null() { return true; }
     bool set_bool(bool) { return true; }
     bool set_number(double) { return true; }
+#ifdef PICOJSON_USE_INT64
+    bool set_int64(int64_t) { return true; }
+#endif
     template <typename Iter> bool parse_string(input<Iter>& in) {
       dummy_str s;
       return _parse_string(s, in);
@@ -20,6 +20,8 @@ struct HttpUserData
 {
     HttpCallback callback;
     int retries;
+    // If false, errors are passed to callback right away.
+    bool retry_errors;
 };
 
 const int MAX_HTTP_RETRIES = 3;
@@ -29,9 +31,13 @@ void http_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, void
 {
     HttpUserData* data = (HttpUserData*)user_data;
     PurpleConnection* gc = purple_http_conn_get_purple_connection(http_conn);
+    VkHttpStats& stats = get_data(gc).http_stats;
+    stats.response_bytes += purple_http_response_get_data_len(response);
     int response_code = purple_http_response_get_code(response);
-    if ((response_code == 0 || response_code >= 500) && data->retries < MAX_HTTP_RETRIES
-            && !get_data(gc).is_closing()) {
+    // Retrying without network is pointless, Long Poll gets suspended until the network is back.
+    if ((response_code == 0 || response_code >= 500) && data->retry_errors
+            && data->retries < MAX_HTTP_RETRIES && !get_data(gc).is_closing()
+            && get_data(gc).network_available) {
         vkcom_debug_error("HTTP error %d, retrying %d time\n",
                            purple_http_response_get_code(response), data->retries + 1);
 
@@ -41,11 +47,16 @@ void http_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, void
         purple_http_request_ref(request);
         timeout_add(gc, 1000, [=] {
             data->retries++;
+            VkHttpStats& retry_stats = get_data(gc).http_stats;
+            retry_stats.requests++;
+            retry_stats.retries++;
             purple_http_request(gc, request, http_cb, data);
             purple_http_request_unref(request);
             return false;
         });
     } else {
+        if (!purple_http_response_is_successful(response))
+            stats.failed++;
         data->callback(http_conn, response);
         delete data;
     }
@@ -54,7 +65,7 @@ void http_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, void
 } // End anonymous namespace
 
 PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* request,
-                                   const HttpCallback& callback)
+                                   const HttpCallback& callback, bool retry_errors)
 {
     VkData& gc_data = get_data(gc);
     if (gc_data.is_closing()) {
@@ -66,6 +77,8 @@ PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* requ
     HttpUserData* data = new HttpUserData();
     data->callback = callback;
     data->retries = 0;
+    data->retry_errors = retry_errors;
+    gc_data.http_stats.requests++;
     PurpleHttpConnection* hc = purple_http_request(gc, request, http_cb, data);
     return hc;
 }
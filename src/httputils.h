@@ -12,8 +12,10 @@ typedef function_ptr<void(PurpleHttpConnection *http_conn, PurpleHttpResponse *r
 PurpleHttpConnection* http_get(PurpleConnection *gc, const string& url, const HttpCallback& callback);
 
 // Utility function: run purple_http_get with keep-alive pool and add to connection set.
+// Network and server errors are retried a few times unless retry_errors is false, in which case
+// the caller is responsible for retrying (e.g. Long Poll has its own backoff).
 PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* request,
-                                   const HttpCallback& callback);
+                                   const HttpCallback& callback, bool retry_errors = true);
 
 // A wrapper around purple_http_request, which updates url in PurpleHttpRequest. This url can be
 // later retrieved inside the callback function. This differs from the standard purple_http_request
@@ -0,0 +1,198 @@
+// Declarative decoding of JSON objects into structs.
+//
+// Instead of checking each field with field_is_present and then looking it up once again via
+// v.get(...).get<T>(), a handler declares the fields it needs once:
+//
+//     struct UserFields
+//     {
+//         uint64 id;
+//         string first_name;
+//         string domain;
+//     };
+//
+//     const JsonSchema<UserFields> user_schema = {
+//         json_field("id", &UserFields::id),
+//         json_field("first_name", &UserFields::first_name),
+//         json_optional_field("domain", &UserFields::domain),
+//     };
+//
+// and decodes the value in one pass over the fields:
+//
+//     UserFields fields = {};
+//     string error;
+//     if (!user_schema.decode(v, fields, error)) ...
+//
+// All missing or mistyped required fields are reported in one error string. Optional fields,
+// which are absent or have the wrong type, keep their initial value.
+
+#pragma once
+
+#include <initializer_list>
+
+#include "common.h"
+#include "miscutils.h"
+
+#include <contrib/picojson/picojson.h>
+
+// Describes how a C++ type is stored in JSON. is() checks the type of JSON value, get() converts it.
+// Arrays and objects are decoded as pointers into the source value, so that no subtrees get copied;
+// the decoded struct must not outlive the value.
+template<typename T>
+struct JsonFieldTraits;
+
+template<>
+struct JsonFieldTraits<string>
+{
+    static bool is(const picojson::value& v) { return v.is<string>(); }
+    static void get(const picojson::value& v, string& out) { out = v.get<string>(); }
+};
+
+// All integer types are decoded from JSON numbers via json_int, there is no rounding via double.
+template<typename T>
+struct JsonIntegerTraits
+{
+    static bool is(const picojson::value& v) { return v.is<double>(); }
+    static void get(const picojson::value& v, T& out) { out = json_int(v); }
+};
+
+template<> struct JsonFieldTraits<uint64> : JsonIntegerTraits<uint64> {};
+template<> struct JsonFieldTraits<int64> : JsonIntegerTraits<int64> {};
+template<> struct JsonFieldTraits<int> : JsonIntegerTraits<int> {};
+
+template<>
+struct JsonFieldTraits<double>
+{
+    static bool is(const picojson::value& v) { return v.is<double>(); }
+    static void get(const picojson::value& v, double& out) { out = v.get<double>(); }
+};
+
+// Vk.com returns boolean flags as 0/1 numbers, so we accept both.
+template<>
+struct JsonFieldTraits<bool>
+{
+    static bool is(const picojson::value& v) { return v.is<bool>() || v.is<double>(); }
+    static void get(const picojson::value& v, bool& out)
+    {
+        if (v.is<bool>())
+            out = v.get<bool>();
+        else
+            out = json_int(v) != 0;
+    }
+};
+
+template<>
+struct JsonFieldTraits<const picojson::array*>
+{
+    static bool is(const picojson::value& v) { return v.is<picojson::array>(); }
+    static void get(const picojson::value& v, const picojson::array*& out)
+    {
+        out = &v.get<picojson::array>();
+    }
+};
+
+// Pointer to JSON value must point to an object.
+template<>
+struct JsonFieldTraits<const picojson::value*>
+{
+    static bool is(const picojson::value& v) { return v.is<picojson::object>(); }
+    static void get(const picojson::value& v, const picojson::value*& out)
+    {
+        out = &v;
+    }
+};
+
+// Accepts a value of any type, for fields like "server" in upload responses, which can be either
+// a number or a string. The value gets copied, so use it only for scalar values.
+template<>
+struct JsonFieldTraits<picojson::value>
+{
+    static bool is(const picojson::value&) { return true; }
+    static void get(const picojson::value& v, picojson::value& out) { out = v; }
+};
+
+// One field of JsonSchema<S>. Use json_field and json_optional_field to create them.
+template<typename S>
+struct JsonSchemaField
+{
+    const char* name;
+    bool optional;
+    bool (*is)(const picojson::value& v);
+    std::function<void(const picojson::value& v, S& out)> get;
+};
+
+template<typename S, typename T>
+JsonSchemaField<S> json_field(const char* name, T S::* member)
+{
+    return { name, false, &JsonFieldTraits<T>::is, [member](const picojson::value& v, S& out) {
+        JsonFieldTraits<T>::get(v, out.*member);
+    }};
+}
+
+template<typename S, typename T>
+JsonSchemaField<S> json_optional_field(const char* name, T S::* member)
+{
+    JsonSchemaField<S> field = json_field(name, member);
+    field.optional = true;
+    return field;
+}
+
+// A list of fields of S, which can be decoded from a JSON object.
+template<typename S>
+class JsonSchema
+{
+public:
+    JsonSchema(std::initializer_list<JsonSchemaField<S>> fields)
+        : m_fields(fields)
+    {
+    }
+
+    // Decodes all the fields from v into out. Returns false and sets error, listing all problems
+    // with v, if v is not an object or any required field is missing or has the wrong type.
+    // out can be partially modified even if false is returned.
+    bool decode(const picojson::value& v, S& out, string& error) const
+    {
+        if (!v.is<picojson::object>()) {
+            error = "not an object";
+            return false;
+        }
+
+        const picojson::object& obj = v.get<picojson::object>();
+        string missing;
+        string mistyped;
+        for (const JsonSchemaField<S>& field: m_fields) {
+            picojson::object::const_iterator it = obj.find(field.name);
+            if (it == obj.end() || it->second.is<picojson::null>()) {
+                if (!field.optional)
+                    append_name(missing, field.name);
+            } else if (!field.is(it->second)) {
+                if (!field.optional)
+                    append_name(mistyped, field.name);
+            } else {
+                field.get(it->second, out);
+            }
+        }
+
+        if (missing.empty() && mistyped.empty())
+            return true;
+
+        error.clear();
+        if (!missing.empty())
+            error = "missing fields: " + missing;
+        if (!mistyped.empty()) {
+            if (!error.empty())
+                error += "; ";
+            error += "fields with wrong type: " + mistyped;
+        }
+        return false;
+    }
+
+private:
+    vector<JsonSchemaField<S>> m_fields;
+
+    static void append_name(string& names, const char* name)
+    {
+        if (!names.empty())
+            names += ", ";
+        names += name;
+    }
+};
@@ -0,0 +1,70 @@
+// A cheap reference to a value inside a parsed JSON document.
+
+#pragma once
+
+#include "common.h"
+
+#include <contrib/picojson/picojson.h>
+
+// Refers to a value inside a parsed JSON document and shares the ownership of the whole document.
+// Copying a view costs one reference count increment instead of a deep copy of the subtree, so
+// the value can be kept after the callback, which has received it, returns (see received_pages
+// in vk-api.cpp). The view converts implicitly to const picojson::value&, so field_is_present,
+// json_int, JsonSchema and the rest accept it as is.
+class JsonView
+{
+public:
+    // A view of null value.
+    JsonView()
+        : m_value(&null_value())
+    {
+    }
+
+    // Takes the parsed document and refers to its root.
+    explicit JsonView(picojson::value&& document)
+        : m_document(new picojson::value(std::move(document)))
+    {
+        m_value = m_document.get();
+    }
+
+    // Returns a view of the object member or the array element, null if there is no such.
+    JsonView get(const string& key) const
+    {
+        return sub(m_value->get(key));
+    }
+
+    JsonView get(size_t idx) const
+    {
+        return sub(m_value->get(idx));
+    }
+
+    // Returns a view of v, which must be a part of this value, e.g. an element of the array,
+    // returned by value().get<picojson::array>().
+    JsonView sub(const picojson::value& v) const
+    {
+        JsonView ret;
+        ret.m_document = m_document;
+        ret.m_value = &v;
+        return ret;
+    }
+
+    const picojson::value& value() const
+    {
+        return *m_value;
+    }
+
+    operator const picojson::value&() const
+    {
+        return *m_value;
+    }
+
+private:
+    shared_ptr<const picojson::value> m_document;
+    const picojson::value* m_value;
+
+    static const picojson::value& null_value()
+    {
+        static const picojson::value null;
+        return null;
+    }
+};
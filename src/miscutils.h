@@ -25,6 +25,19 @@ string urlencode_form(const vector<pair<string, string>>& params);
 // Returns mapping key -> value from urlencoded form.
 map<string, string> parse_urlencoded_form(const char* encoded);
 
+// Returns the value of JSON number as integer. Picojson parses integers exactly as int64 (see
+// PICOJSON_USE_INT64 in CMakeLists.txt), while get<double>() would convert the value to double
+// in place, so ids, timestamps and other integers must always be read via json_int. Use
+// field_is_present<double> to check for a number.
+inline int64 json_int(const picojson::value& v)
+{
+#ifdef PICOJSON_USE_INT64
+    if (v.is<int64_t>())
+        return v.get<int64_t>();
+#endif
+    return v.get<double>();
+}
+
 // Checks if JSON value is an object, contains key and the type of value for that key is T.
 template<typename T>
 bool field_is_present(const picojson::value& v, const string& key)
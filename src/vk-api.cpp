@@ -1,3 +1,5 @@
+#include <deque>
+
 #include <request.h>
 
 #include <contrib/purple/http.h>
@@ -18,18 +20,80 @@ struct VkCall
 {
     string method_name;
     CallParams params;
+    VkCallPriority priority;
+    // Repeated calls are put in front of the queue.
+    bool is_retry;
 };
 
+// Returns base URL for API calls. It can be overridden with VKCOM_API_URL environment variable,
+// e.g. for running the plugin against a local mock server (see bench/README.txt).
+const string& get_api_url()
+{
+    static const string api_url = g_getenv("VKCOM_API_URL") ? g_getenv("VKCOM_API_URL")
+                                                            : "https://api.vk.com";
+    return api_url;
+}
+
+// Returns priority of the call to given method.
+VkCallPriority get_call_priority(const string& method_name);
+
+// Callback, which receives the whole response root element (both "response" and, for "execute",
+// "execute_errors").
+typedef function_ptr<void(const JsonView& root)> CallRootCb;
+
+// Callback, which repeats the failed call.
+typedef function_ptr<void()> CallRetryCb;
+
+// Performs the call and passes the response root to root_cb. All API calls are done via this function.
+void vk_call_api_impl(PurpleConnection* gc, const VkCall& call, const CallRootCb& root_cb,
+                      const CallErrorCb& error_cb);
+
+// Sends the call, which has been waiting in queue since queued_time.
+void send_call(PurpleConnection* gc, const VkCall& call, steady_time_point queued_time,
+               const CallRootCb& root_cb, const CallErrorCb& error_cb);
+
 // Callback, which is called upon receiving response to API call.
-void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, const VkCall& call,
-                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb);
+void on_vk_call_cb(PurpleConnection* gc, PurpleHttpResponse* response, const VkCall& call,
+                   const CallRootCb& root_cb, const CallErrorCb& error_cb);
+
+// Process error: maybe call retry_cb and/or re-authorize.
+void process_error(PurpleConnection* gc, const picojson::value& error, const CallRetryCb& retry_cb,
+                   const CallErrorCb& error_cb);
+
+// Sends all calls, collected by vk_call_api_batched.
+void flush_batched_calls(PurpleConnection* gc);
 
 } // End of anonymous namespace
 
 void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams& params,
                  const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
 {
-    vkcom_debug_info("    API call %s\n", method_name);
+    VkCall call;
+    call.method_name = method_name;
+    call.params = params;
+    call.priority = get_call_priority(call.method_name);
+    call.is_retry = false;
+
+    vk_call_api_impl(gc, call, [=](const JsonView& root) {
+        if (success_cb)
+            success_cb(root.get("response"));
+    }, error_cb);
+}
+
+// One call, waiting to be sent as a part of "execute".
+struct VkBatchedCall
+{
+    string method_name;
+    CallParams params;
+    CallSuccessCb success_cb;
+    CallErrorCb error_cb;
+};
+
+void vk_call_api_batched(PurpleConnection* gc, const char* method_name, const CallParams& params,
+                         const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
+{
+    // Calls are collected during this time window and then sent all at once.
+    const int BATCH_WINDOW = 10;
 
     VkData& gc_data = get_data(gc);
     if (gc_data.is_closing()) {
@@ -37,55 +101,365 @@ void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams
         return;
     }
 
-    VkCall call;
-    call.method_name = method_name;
-    call.params = params;
+    shared_ptr<VkBatchedCall> call{ new VkBatchedCall() };
+    call->method_name = method_name;
+    call->params = params;
+    call->success_cb = success_cb;
+    call->error_cb = error_cb;
+
+    // The first call in the batch starts the timer, the others just get appended.
+    gc_data.batched_calls.push_back(call);
+    if (gc_data.batched_calls.size() == 1) {
+        timeout_add(gc, BATCH_WINDOW, [=] {
+            flush_batched_calls(gc);
+            return false;
+        });
+    }
+}
+
+// The state of rate limiting and the queue of calls, waiting to be sent.
+struct VkCallQueue
+{
+    // A call, waiting in the queue.
+    struct QueuedCall
+    {
+        SuccessCb send_cb;
+        steady_time_point queued_time;
+        // True if the call has been held in queue, because no tokens were left.
+        bool delayed;
+    };
+
+    std::deque<QueuedCall> queues[VK_NUM_CALL_PRIORITIES];
+    // Send times of the last calls. Vk.com allows no more than MAX_CALLS_PER_PERIOD during
+    // RATE_LIMIT_PERIOD, so this is essentially a token bucket, where each token returns to
+    // the bucket after RATE_LIMIT_PERIOD since it has been taken.
+    std::deque<steady_time_point> sent_times;
+    // True if timer, sending the calls, has been added.
+    bool timer_added;
+
+    VkCallQueueStats stats;
+    VkMethodStatsMap method_stats;
+};
+
+namespace
+{
+
+const size_t MAX_CALLS_PER_PERIOD = 3;
+// A small margin is added to a second to account for network delays.
+const std::chrono::milliseconds RATE_LIMIT_PERIOD(1100);
 
-    string method_url = str_format("https://api.vk.com/method/%s?v=%s&access_token=%s", method_name,
-                                   api_version, gc_data.access_token().data());
+VkCallQueue& get_call_queue(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    // Value-initialization zeroes timer_added and all the stats.
+    if (!gc_data.call_queue)
+        gc_data.call_queue.reset(new VkCallQueue());
+    return *gc_data.call_queue;
+}
+
+// Sends as many queued calls as the rate limit allows. If some calls are left in the queue,
+// adds timer to send them later.
+void process_call_queue(PurpleConnection* gc)
+{
+    VkCallQueue& queue = get_call_queue(gc);
+    while (true) {
+        VkCallPriority priority = VK_NUM_CALL_PRIORITIES;
+        for (int i = 0; i < VK_NUM_CALL_PRIORITIES; i++) {
+            if (!queue.queues[i].empty()) {
+                priority = VkCallPriority(i);
+                break;
+            }
+        }
+        if (priority == VK_NUM_CALL_PRIORITIES)
+            return;
+
+        steady_time_point now = steady_clock::now();
+        while (!queue.sent_times.empty() && now - queue.sent_times.front() >= RATE_LIMIT_PERIOD)
+            queue.sent_times.pop_front();
+
+        if (queue.sent_times.size() >= MAX_CALLS_PER_PERIOD) {
+            // All the calls left in queue are held for the rate limit.
+            for (std::deque<VkCallQueue::QueuedCall>& q: queue.queues)
+                for (VkCallQueue::QueuedCall& c: q)
+                    c.delayed = true;
+
+            if (!queue.timer_added) {
+                steady_duration wait = RATE_LIMIT_PERIOD - (now - queue.sent_times.front());
+                queue.timer_added = true;
+                timeout_add(gc, to_milliseconds(wait) + 1, [=] {
+                    get_call_queue(gc).timer_added = false;
+                    process_call_queue(gc);
+                    return false;
+                });
+            }
+            return;
+        }
+
+        VkCallQueue::QueuedCall call = queue.queues[priority].front();
+        queue.queues[priority].pop_front();
+        queue.sent_times.push_back(now);
+
+        VkCallQueueStats& stats = queue.stats;
+        stats.queue_size[priority]--;
+        stats.calls_sent++;
+        if (call.delayed) {
+            steady_duration wait = now - call.queued_time;
+            stats.calls_delayed++;
+            stats.total_wait += wait;
+            stats.max_wait = std::max(stats.max_wait, wait);
+        }
+
+        call.send_cb();
+    }
+}
+
+// Adds call to the queue and sends it immediately if rate limit allows.
+void schedule_call(PurpleConnection* gc, VkCallPriority priority, bool in_front, const SuccessCb& send_cb)
+{
+    VkCallQueue& queue = get_call_queue(gc);
+    VkCallQueue::QueuedCall call = { send_cb, steady_clock::now(), false };
+    if (in_front)
+        queue.queues[priority].push_front(call);
+    else
+        queue.queues[priority].push_back(call);
+
+    VkCallQueueStats& stats = queue.stats;
+    stats.queue_size[priority]++;
+    size_t total_size = 0;
+    for (size_t queue_size: stats.queue_size)
+        total_size += queue_size;
+    stats.max_queue_size = std::max(stats.max_queue_size, total_size);
+
+    process_call_queue(gc);
+}
+
+// Called upon receiving "Too many requests per second". We must have been not the only
+// client, making the calls, so we drain the bucket and wait for the whole period.
+void on_rate_limit_hit(PurpleConnection* gc)
+{
+    VkCallQueue& queue = get_call_queue(gc);
+    queue.stats.rate_limit_errors++;
+
+    steady_time_point now = steady_clock::now();
+    queue.sent_times.assign(MAX_CALLS_PER_PERIOD, now);
+}
+
+// Returns statistics for method, creating zeroed entry if needed.
+VkMethodStats& get_method_stats(PurpleConnection* gc, const string& method_name)
+{
+    return get_call_queue(gc).method_stats[method_name];
+}
+
+// Adds duration to the corresponding bucket of histogram.
+void add_to_histogram(uint64 (&histogram)[VK_LATENCY_HISTOGRAM_SIZE], steady_duration duration)
+{
+    int64 ms = to_milliseconds(duration);
+    int bucket = 0;
+    while (bucket < VK_LATENCY_HISTOGRAM_SIZE - 1 && ms >= (int64(1) << bucket))
+        bucket++;
+    histogram[bucket]++;
+}
+
+// Counts error, returned by Vk.com for the call to method_name.
+void record_call_error(PurpleConnection* gc, const string& method_name, const picojson::value& error)
+{
+    int error_code = 0;
+    if (field_is_present<double>(error, "error_code"))
+        error_code = json_int(error.get("error_code"));
+    get_method_stats(gc, method_name).errors[error_code]++;
+}
+
+// Formats histogram as a list of "<bound: count" pairs, skipping empty buckets.
+string histogram_to_string(const uint64 (&histogram)[VK_LATENCY_HISTOGRAM_SIZE])
+{
+    string ret;
+    for (int i = 0; i < VK_LATENCY_HISTOGRAM_SIZE; i++) {
+        if (histogram[i] == 0)
+            continue;
+        if (!ret.empty())
+            ret += ", ";
+        if (i < VK_LATENCY_HISTOGRAM_SIZE - 1)
+            ret += str_format("<%lldms: %llu", (long long)1 << i, (unsigned long long)histogram[i]);
+        else
+            ret += str_format(">=%lldms: %llu", (long long)1 << (i - 1),
+                              (unsigned long long)histogram[i]);
+    }
+    return ret;
+}
+
+} // End of anonymous namespace
+
+const VkCallQueueStats& vk_call_queue_stats(PurpleConnection* gc)
+{
+    return get_call_queue(gc).stats;
+}
+
+const VkMethodStatsMap& vk_call_method_stats(PurpleConnection* gc)
+{
+    return get_call_queue(gc).method_stats;
+}
+
+string vk_call_stats_to_string(PurpleConnection* gc)
+{
+    const VkHttpStats& http_stats = get_data(gc).http_stats;
+    string ret = str_format("HTTP: %llu requests, %llu retries, %llu failed, %llu bytes received\n",
+                            (unsigned long long)http_stats.requests,
+                            (unsigned long long)http_stats.retries,
+                            (unsigned long long)http_stats.failed,
+                            (unsigned long long)http_stats.response_bytes);
+
+    const VkProcessingStats& processing_stats = get_data(gc).processing_stats;
+    ret += str_format("Processing: %llu responses parsed in %lldms, %llu Long Poll updates processed in %lldms, "
+                      "%llu messages decoded in %lldms, %llu messages written in %lldms\n",
+                      (unsigned long long)processing_stats.parsed_responses,
+                      (long long)to_milliseconds(processing_stats.parse_time),
+                      (unsigned long long)processing_stats.long_poll_updates,
+                      (long long)to_milliseconds(processing_stats.long_poll_time),
+                      (unsigned long long)processing_stats.decoded_messages,
+                      (long long)to_milliseconds(processing_stats.decode_time),
+                      (unsigned long long)processing_stats.written_messages,
+                      (long long)to_milliseconds(processing_stats.write_time));
+
+    const VkCallQueueStats& queue_stats = vk_call_queue_stats(gc);
+    ret += str_format("API queue: %llu calls sent, %llu delayed, max wait %lldms, max queue size %d, "
+                      "%llu rate limit errors\n", (unsigned long long)queue_stats.calls_sent,
+                      (unsigned long long)queue_stats.calls_delayed,
+                      (long long)to_milliseconds(queue_stats.max_wait),
+                      (int)queue_stats.max_queue_size,
+                      (unsigned long long)queue_stats.rate_limit_errors);
+
+    for (const VkMethodStatsMap::value_type& p: vk_call_method_stats(gc)) {
+        const VkMethodStats& stats = p.second;
+        ret += str_format("%s: %llu calls, %llu retries, %llu network errors, %llu bytes sent, "
+                          "%llu bytes received\n", p.first.data(), (unsigned long long)stats.calls,
+                          (unsigned long long)stats.retries,
+                          (unsigned long long)stats.network_errors,
+                          (unsigned long long)stats.request_bytes,
+                          (unsigned long long)stats.response_bytes);
+        if (!stats.errors.empty()) {
+            string errors;
+            for (const pair<int, uint64>& e: stats.errors) {
+                if (!errors.empty())
+                    errors += ", ";
+                errors += str_format("%d: %llu", e.first, (unsigned long long)e.second);
+            }
+            ret += "    errors by code: " + errors + "\n";
+        }
+        string queue_wait = histogram_to_string(stats.queue_wait);
+        if (!queue_wait.empty())
+            ret += "    queue wait: " + queue_wait + "\n";
+        string latency = histogram_to_string(stats.latency);
+        if (!latency.empty())
+            ret += "    latency: " + latency + "\n";
+    }
+    return ret;
+}
+
+namespace
+{
+
+VkCallPriority get_call_priority(const string& method_name)
+{
+    static const map<string, VkCallPriority> priorities = {
+        { "messages.send", VK_PRIORITY_USER_ACTION },
+        { "messages.markAsRead", VK_PRIORITY_USER_ACTION },
+        { "messages.setActivity", VK_PRIORITY_USER_ACTION },
+        { "messages.addChatUser", VK_PRIORITY_USER_ACTION },
+        { "messages.removeChatUser", VK_PRIORITY_USER_ACTION },
+        { "messages.editChat", VK_PRIORITY_USER_ACTION },
+        { "docs.getWallUploadServer", VK_PRIORITY_USER_ACTION },
+        { "docs.save", VK_PRIORITY_USER_ACTION },
+        { "photos.getMessagesUploadServer", VK_PRIORITY_USER_ACTION },
+        { "photos.saveMessagesPhoto", VK_PRIORITY_USER_ACTION },
+        { "utils.resolveScreenName", VK_PRIORITY_USER_ACTION },
+
+        { "messages.getLongPollServer", VK_PRIORITY_LONG_POLL },
+        { "messages.get", VK_PRIORITY_LONG_POLL },
+        { "messages.getById", VK_PRIORITY_LONG_POLL },
+        { "execute", VK_PRIORITY_LONG_POLL },
+
+        { "friends.getOnline", VK_PRIORITY_PRESENCE },
+        { "account.setOnline", VK_PRIORITY_PRESENCE },
+        { "account.setOffline", VK_PRIORITY_PRESENCE },
+
+        { "friends.get", VK_PRIORITY_INFO },
+        { "messages.getDialogs", VK_PRIORITY_INFO },
+        { "messages.getChat", VK_PRIORITY_INFO },
+        { "users.get", VK_PRIORITY_INFO },
+        { "groups.getById", VK_PRIORITY_INFO },
+        { "status.set", VK_PRIORITY_INFO },
+    };
+
+    auto it = priorities.find(method_name);
+    if (it != priorities.end())
+        return it->second;
+    else
+        return VK_PRIORITY_BACKGROUND;
+}
+
+void vk_call_api_impl(PurpleConnection* gc, const VkCall& call, const CallRootCb& root_cb,
+                      const CallErrorCb& error_cb)
+{
+    vkcom_debug_info("    API call %s\n", call.method_name.data());
+
+    VkData& gc_data = get_data(gc);
+    if (gc_data.is_closing()) {
+        vkcom_debug_error("Programming error: API method %s called during logout\n",
+                          call.method_name.data());
+        return;
+    }
+
+    steady_time_point queued_time = steady_clock::now();
+    schedule_call(gc, call.priority, call.is_retry, [=] {
+        send_call(gc, call, queued_time, root_cb, error_cb);
+    });
+}
+
+void send_call(PurpleConnection* gc, const VkCall& call, steady_time_point queued_time,
+               const CallRootCb& root_cb, const CallErrorCb& error_cb)
+{
+    // The call could have been waiting in the queue while connection started closing.
+    VkData& gc_data = get_data(gc);
+    if (gc_data.is_closing())
+        return;
+
+    string method_url = str_format("%s/method/%s?v=%s&access_token=%s", get_api_url().data(),
+                                   call.method_name.data(), api_version, gc_data.access_token().data());
     PurpleHttpRequest* req = purple_http_request_new(method_url.data());
     purple_http_request_set_method(req, "POST");
     purple_http_request_header_add(req, "Content-Type", "application/x-www-form-urlencoded");
-    if (!params.empty()) {
-        string body = urlencode_form(params);
+    size_t request_bytes = method_url.length();
+    if (!call.params.empty()) {
+        string body = urlencode_form(call.params);
         purple_http_request_set_contents(req, body.data(), body.length());
+        request_bytes += body.length();
     }
 
-    http_request(gc, req, [=](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
+    steady_time_point sent_time = steady_clock::now();
+    VkMethodStats& stats = get_method_stats(gc, call.method_name);
+    stats.calls++;
+    if (call.is_retry)
+        stats.retries++;
+    stats.request_bytes += request_bytes;
+    add_to_histogram(stats.queue_wait, sent_time - queued_time);
+
+    http_request(gc, req, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
         // Connection has been cancelled due to account being disconnected. Do not do any response
         // processing, as callbacks may initiate new HTTP requests.
         if (get_data(gc).is_closing())
             return;
 
-        on_vk_call_cb(http_conn, response, call, success_cb, error_cb);
-    });
-    purple_http_request_unref(req);
-}
+        VkMethodStats& response_stats = get_method_stats(gc, call.method_name);
+        response_stats.response_bytes += purple_http_response_get_data_len(response);
+        add_to_histogram(response_stats.latency, steady_clock::now() - sent_time);
 
-namespace
-{
-
-// Someone started authentication, waits until the auth token is set and repeats the call.
-void vk_call_after_auth(PurpleConnection* gc, const VkCall& call,
-                        const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
-{
-    // Try repeating in a second.
-    const int WAIT_AUTH_TIMEOUT = 1000;
-    vkcom_debug_info("Authentication already in progress, retrying in %d msec\n", WAIT_AUTH_TIMEOUT);
-
-    // This loop stops in case of failed authentication, because all timeouts die.
-    timeout_add(gc, WAIT_AUTH_TIMEOUT, [=] {
-        if (get_data(gc).is_authenticating())
-            vk_call_after_auth(gc, call, success_cb, error_cb);
-        else
-            vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
-        return false;
+        on_vk_call_cb(gc, response, call, root_cb, error_cb);
     });
+    purple_http_request_unref(req);
 }
 
-// Process error: maybe do another call and/or re-authorize.
-void process_error(PurpleHttpConnection* http_conn, const picojson::value& error, const VkCall &call,
-                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
+void process_error(PurpleConnection* gc, const picojson::value& error, const CallRetryCb& retry_cb,
+                   const CallErrorCb& error_cb)
 {
     if (!error.is<picojson::object>()) {
         vkcom_debug_error("Unknown error response: %s\n", error.serialize().data());
@@ -101,34 +475,30 @@ void process_error(PurpleHttpConnection* http_conn, const picojson::value& error
         return;
     }
 
-    int error_code = error.get("error_code").get<double>();
+    int error_code = json_int(error.get("error_code"));
     vkcom_debug_info("Got error code %d\n", error_code);
-    PurpleConnection* gc = purple_http_conn_get_purple_connection(http_conn);
     VkData& gc_data = get_data(gc);
 
     if (error_code == VK_AUTHORIZATION_FAILED) {
-        // Check if another authentication process has already started
-        if (gc_data.is_authenticating()) {
-            vk_call_after_auth(gc, call, success_cb, error_cb);
-        } else {
+        // Check if another authentication process has already started. If it has, authenticate
+        // just waits for it to finish.
+        if (!gc_data.is_authenticating()) {
             vkcom_debug_info("Access token expired, doing a reauthorization\n");
-
             gc_data.clear_access_token();
-            gc_data.authenticate([=] {
-                vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
-            }, [=] {
-                if (error_cb)
-                    error_cb(picojson::value());
-            });
         }
-    } else if (error_code == VK_TOO_MANY_REQUESTS_PER_SECOND) {
-        const int RETRY_TIMEOUT = 400; // 400msec is less than 3 requests per second (the current rate limit on Vk.com
-        vkcom_debug_info("Call rate limit hit, retrying in %d msec\n", RETRY_TIMEOUT);
 
-        timeout_add(gc, RETRY_TIMEOUT, [=] {
-            vk_call_api(gc, call.method_name.data(), call.params, success_cb, error_cb);
-            return false;
+        gc_data.authenticate([=] {
+            retry_cb();
+        }, [=] {
+            if (error_cb)
+                error_cb(picojson::value());
         });
+    } else if (error_code == VK_TOO_MANY_REQUESTS_PER_SECOND) {
+        // Someone else is making calls with the same token, the call is repeated, when the rate limit
+        // allows it.
+        vkcom_debug_info("Call rate limit hit, delaying the calls\n");
+        on_rate_limit_hit(gc);
+        retry_cb();
     } else if (error_code == VK_FLOOD_CONTROL) {
         // Simply ignore the error.
     } else if (error_code == VK_VALIDATION_REQUIRED) {
@@ -181,22 +551,29 @@ void process_error(PurpleHttpConnection* http_conn, const picojson::value& error
     }
 }
 
-void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, const VkCall &call,
-                   const CallSuccessCb& success_cb, const CallErrorCb& error_cb)
+void on_vk_call_cb(PurpleConnection* gc, PurpleHttpResponse* response, const VkCall& call,
+                   const CallRootCb& root_cb, const CallErrorCb& error_cb)
 {
     if (!purple_http_response_is_successful(response)) {
         vkcom_debug_error("Error while calling API: %s\n", purple_http_response_get_error(response));
+        get_method_stats(gc, call.method_name).network_errors++;
         if (error_cb)
             error_cb(picojson::value());
         return;
     }
 
     const char* response_text = purple_http_response_get_data(response, nullptr);
+    capture_response(gc, "api:" + call.method_name, response_text);
     const char* response_text_copy = response_text; // Picojson updates iterators it received.
     picojson::value root;
+    steady_time_point parse_start = steady_clock::now();
     string error = picojson::parse(root, response_text, response_text + strlen(response_text));
+    VkProcessingStats& processing_stats = get_data(gc).processing_stats;
+    processing_stats.parsed_responses++;
+    processing_stats.parse_time += steady_clock::now() - parse_start;
     if (!error.empty()) {
         vkcom_debug_error("Error parsing %s: %s\n", response_text_copy, error.data());
+        get_method_stats(gc, call.method_name).network_errors++;
         if (error_cb)
             error_cb(picojson::value());
         return;
@@ -204,7 +581,12 @@ void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response
 
     // Process all errors, potentially re-executing the request.
     if (root.contains("error")) {
-        process_error(http_conn, root.get("error"), call, success_cb, error_cb);
+        record_call_error(gc, call.method_name, root.get("error"));
+        process_error(gc, root.get("error"), [=] {
+            VkCall retry_call = call;
+            retry_call.is_retry = true;
+            vk_call_api_impl(gc, retry_call, root_cb, error_cb);
+        }, error_cb);
         return;
     }
 
@@ -215,8 +597,120 @@ void on_vk_call_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response
         return;
     }
 
-    if (success_cb)
-        success_cb(root.get("response"));
+    root_cb(JsonView(std::move(root)));
+}
+
+typedef shared_ptr<VkBatchedCall> VkBatchedCall_ptr;
+typedef shared_ptr<vector<VkBatchedCall_ptr>> VkBatch_ptr;
+
+// Converts call parameters to VKScript object literal.
+string call_params_to_vkscript(const CallParams& params)
+{
+    string ret = "{";
+    for (const CallParams::value_type& p: params) {
+        if (ret.size() > 1)
+            ret += ",";
+        ret += picojson::value(p.first).serialize();
+        ret += ":";
+        ret += picojson::value(p.second).serialize();
+    }
+    ret += "}";
+    return ret;
+}
+
+// Processes response to "execute" and passes the results to individual calls. Failed calls
+// return false in the response array and the corresponding errors are stored in "execute_errors"
+// in the same order.
+void on_batch_cb(PurpleConnection* gc, const VkBatch_ptr& batch, const JsonView& root)
+{
+    if (!field_is_present<picojson::array>(root, "response")
+            || root.value().get("response").get<picojson::array>().size() != batch->size()) {
+        vkcom_debug_error("Strange response to batched call: %s\n", root.value().serialize().data());
+        for (const VkBatchedCall_ptr& call: *batch)
+            if (call->error_cb)
+                call->error_cb(picojson::value());
+        return;
+    }
+
+    JsonView results = root.get("response");
+    static const picojson::array no_errors;
+    const picojson::array& errors = field_is_present<picojson::array>(root, "execute_errors")
+                                    ? root.value().get("execute_errors").get<picojson::array>() : no_errors;
+
+    size_t error_index = 0;
+    for (size_t i = 0; i < batch->size(); i++) {
+        VkBatchedCall_ptr call = (*batch)[i];
+        JsonView result = results.get(i);
+        if (result.value().is<bool>() && !result.value().get<bool>()) {
+            picojson::value error;
+            if (error_index < errors.size())
+                error = errors[error_index];
+            error_index++;
+
+            record_call_error(gc, call->method_name, error);
+            process_error(gc, error, [=] {
+                get_method_stats(gc, call->method_name).retries++;
+                vk_call_api_batched(gc, call->method_name.data(), call->params, call->success_cb,
+                                    call->error_cb);
+            }, call->error_cb);
+        } else {
+            if (call->success_cb)
+                call->success_cb(result);
+        }
+    }
+}
+
+// Sends calls as one "execute" call or as a plain call, if there is only one.
+void send_batch(PurpleConnection* gc, const VkBatch_ptr& batch)
+{
+    if (batch->size() == 1) {
+        const VkBatchedCall& call = *batch->front();
+        vk_call_api(gc, call.method_name.data(), call.params, call.success_cb, call.error_cb);
+        return;
+    }
+
+    string code = "return [";
+    for (const VkBatchedCall_ptr& call: *batch) {
+        if (code.back() != '[')
+            code += ",";
+        code += "API." + call->method_name + "(" + call_params_to_vkscript(call->params) + ")";
+    }
+    code += "];";
+
+    vkcom_debug_info("Sending %d API calls in one batch\n", (int)batch->size());
+    for (const VkBatchedCall_ptr& c: *batch)
+        get_method_stats(gc, c->method_name).calls++;
+
+    VkCall call;
+    call.method_name = "execute";
+    call.params = { {"code", code} };
+    // The batch is as urgent as the most urgent call in it.
+    call.priority = VK_PRIORITY_BACKGROUND;
+    for (const VkBatchedCall_ptr& c: *batch)
+        call.priority = std::min(call.priority, get_call_priority(c->method_name));
+    call.is_retry = false;
+    vk_call_api_impl(gc, call, [=](const JsonView& root) {
+        on_batch_cb(gc, batch, root);
+    }, [=](const picojson::value& error) {
+        for (const VkBatchedCall_ptr& c: *batch)
+            if (c->error_cb)
+                c->error_cb(error);
+    });
+}
+
+void flush_batched_calls(PurpleConnection* gc)
+{
+    // Vk.com allows no more than 25 API calls in one "execute".
+    const size_t MAX_BATCH_SIZE = 25;
+
+    vector<VkBatchedCall_ptr> calls;
+    calls.swap(get_data(gc).batched_calls);
+
+    for (size_t start = 0; start < calls.size(); start += MAX_BATCH_SIZE) {
+        size_t end = std::min(start + MAX_BATCH_SIZE, calls.size());
+        VkBatch_ptr batch{ new vector<VkBatchedCall_ptr>(calls.begin() + start, calls.begin() + end) };
+        send_batch(gc, batch);
+    }
 }
 
 
@@ -246,21 +740,21 @@ void vk_call_api_items_impl(PurpleConnection* gc, const char* method_name,
         add_or_replace_call_param(*params, "offset", to_string(offset).data());
     }
 
-    vk_call_api(gc, method_name, *params, [=] (const picojson::value& result) {
+    vk_call_api(gc, method_name, *params, [=] (const JsonView& result) {
         if (!field_is_present<picojson::array>(result, "items")
                 || !field_is_present<double>(result, "count")) {
             vkcom_debug_error("Strange response, no 'count' and/or 'items' are present: %s\n",
-                               result.serialize().data());
+                               result.value().serialize().data());
             if (error_cb)
                 error_cb(picojson::value());
             return;
         }
 
-        const picojson::array& items = result.get("items").get<picojson::array>();
+        const picojson::array& items = result.value().get("items").get<picojson::array>();
         for (const picojson::value& v: items)
-            call_process_item_cb(v);
+            call_process_item_cb(result.sub(v));
 
-        uint64 count = result.get("count").get<double>();
+        uint64 count = json_int(result.get("count"));
         size_t next_offset = offset + items.size();
         // Either we've received all items or method does not have pagination.
         if (next_offset >= count || items.empty() || !pagination) {
@@ -273,12 +767,145 @@ void vk_call_api_items_impl(PurpleConnection* gc, const char* method_name,
     }, error_cb);
 }
 
+// The state of vk_call_api_items with several pages requested simultaneously.
+struct ParallelItemsData
+{
+    PurpleConnection* gc;
+    string method_name;
+    CallParams params;
+    CallProcessItemCb call_process_item_cb;
+    CallFinishedCb call_finished_cb;
+    CallErrorCb error_cb;
+    size_t max_parallel_pages;
+
+    // Page size and total count are known after receiving the first page.
+    size_t page_size;
+    size_t count;
+    // Offset of the next page to request.
+    size_t next_request_offset;
+    // Offset of the next page to pass to call_process_item_cb. Pages, received out of order,
+    // wait in received_pages.
+    size_t next_process_offset;
+    map<size_t, JsonView> received_pages;
+    size_t pages_running;
+    // Set either upon error or upon calling call_finished_cb. All pages, received later, are ignored.
+    bool done;
+};
+typedef shared_ptr<ParallelItemsData> ParallelItemsData_ptr;
+
+void request_items_page(const ParallelItemsData_ptr& data, size_t offset);
+
+// Requests next pages until max_parallel_pages are running or all pages are requested.
+void request_items_pages(const ParallelItemsData_ptr& data)
+{
+    while (data->pages_running < data->max_parallel_pages && data->next_request_offset < data->count) {
+        size_t offset = data->next_request_offset;
+        data->next_request_offset += data->page_size;
+        request_items_page(data, offset);
+    }
+}
+
+// Passes all received pages in offset order to call_process_item_cb.
+void process_items_pages(const ParallelItemsData_ptr& data)
+{
+    while (!data->received_pages.empty()
+           && data->received_pages.begin()->first == data->next_process_offset) {
+        const JsonView& items = data->received_pages.begin()->second;
+        for (const picojson::value& v: items.value().get<picojson::array>())
+            data->call_process_item_cb(items.sub(v));
+
+        data->received_pages.erase(data->received_pages.begin());
+        data->next_process_offset += data->page_size;
+    }
+
+    if (data->next_process_offset >= data->count) {
+        data->done = true;
+        if (data->call_finished_cb)
+            data->call_finished_cb();
+    } else {
+        request_items_pages(data);
+    }
+}
+
+void request_items_page(const ParallelItemsData_ptr& data, size_t offset)
+{
+    CallParams params = data->params;
+    if (offset > 0) {
+        vkcom_debug_info("    API call with offset %d\n", (int)offset);
+        add_or_replace_call_param(params, "offset", to_string(offset).data());
+    }
+
+    data->pages_running++;
+    vk_call_api(data->gc, data->method_name.data(), params, [=] (const JsonView& result) {
+        data->pages_running--;
+        if (data->done)
+            return;
+
+        if (!field_is_present<picojson::array>(result, "items")
+                || !field_is_present<double>(result, "count")) {
+            vkcom_debug_error("Strange response, no 'count' and/or 'items' are present: %s\n",
+                               result.value().serialize().data());
+            data->done = true;
+            if (data->error_cb)
+                data->error_cb(picojson::value());
+            return;
+        }
+
+        JsonView items = result.get("items");
+        size_t items_size = items.value().get<picojson::array>().size();
+        if (offset == 0) {
+            data->page_size = items_size;
+            data->count = json_int(result.get("count"));
+            data->next_request_offset = items_size;
+            // The page can be shorter than requested "count", if the method caps the page size, so
+            // only an empty page means there are no more items, like in vk_call_api_items_impl.
+            if (items_size == 0)
+                data->count = 0;
+        } else if (items_size < data->page_size) {
+            // Items have been removed since the first page, no pages after this one can contain
+            // anything.
+            data->count = std::min(data->count, offset + items_size);
+        }
+
+        if (offset < data->count)
+            data->received_pages[offset] = items;
+        process_items_pages(data);
+    }, [=](const picojson::value& error) {
+        data->pages_running--;
+        if (data->done)
+            return;
+
+        data->done = true;
+        if (data->error_cb)
+            data->error_cb(error);
+    });
+}
+
 } // End of anonymous namespace
 
 void vk_call_api_items(PurpleConnection* gc, const char* method_name, const CallParams& params, bool pagination,
                        const CallProcessItemCb& call_process_item_cb, const CallFinishedCb& call_finished_cb,
-                       const CallErrorCb& error_cb)
+                       const CallErrorCb& error_cb, size_t max_parallel_pages)
 {
+    if (pagination && max_parallel_pages > 1) {
+        ParallelItemsData_ptr data{ new ParallelItemsData() };
+        data->gc = gc;
+        data->method_name = method_name;
+        data->params = params;
+        data->call_process_item_cb = call_process_item_cb;
+        data->call_finished_cb = call_finished_cb;
+        data->error_cb = error_cb;
+        data->max_parallel_pages = max_parallel_pages;
+        data->page_size = 0;
+        data->count = 0;
+        data->next_request_offset = 0;
+        data->next_process_offset = 0;
+        data->pages_running = 0;
+        data->done = false;
+        request_items_page(data, 0);
+        return;
+    }
+
     CallParams_ptr params_ptr{ new CallParams(params) };
     vk_call_api_items_impl(gc, method_name, params_ptr, pagination, call_process_item_cb,
                            call_finished_cb, error_cb, 0);
@@ -2,8 +2,10 @@
 
 #pragma once
 
+#include <map>
 #include <utility>
 
+using std::map;
 using std::pair;
 
 #include "common.h"
@@ -12,22 +14,102 @@ using std::pair;
 
 #include "contrib/picojson/picojson.h"
 
-// Calls method with params.
+#include "json-view.h"
+
+// Calls method with params. All calls are scheduled so that Vk.com rate limit (3 calls per second)
+// is never exceeded, calls with higher priority (see VkCallPriority) are sent first. The result
+// shares the ownership of the whole response, so success_cb may keep it (or its parts) cheaply.
 typedef vector<pair<string, string>> CallParams;
-typedef function_ptr<void(const picojson::value& result)> CallSuccessCb;
+typedef function_ptr<void(const JsonView& result)> CallSuccessCb;
 typedef function_ptr<void(const picojson::value& error)> CallErrorCb;
 void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams& params,
                  const CallSuccessCb& success_cb, const CallErrorCb& error_cb);
 
+// Same as vk_call_api, but the call is delayed for a few milliseconds and sent along with all other
+// calls made during that time in one "execute" call. This greatly reduces the number of requests
+// during login and periodic updates. Errors are processed separately for each call, just like
+// in vk_call_api.
+void vk_call_api_batched(PurpleConnection* gc, const char* method_name, const CallParams& params,
+                         const CallSuccessCb& success_cb, const CallErrorCb& error_cb);
+
 // Helper function for calling APIs with "messages.get" or "messages.getDialogs" which return
 // "items" array as a part of return value and may accept "offset" as a parameter.
 //
 // pagination is true for methods which accept "offset", false otherwise,
 // call_process_item_cb is called for each item in the array,
 // call_finished_cb is called upon completion,
-// error_cb is called upon error.
-typedef function_ptr<void(const picojson::value&)> CallProcessItemCb;
+// error_cb is called upon error,
+// max_parallel_pages is the number of pages, which may be requested simultaneously after the first
+// page has been received. Items are passed to call_process_item_cb in offset order in any case.
+typedef function_ptr<void(const JsonView& item)> CallProcessItemCb;
 typedef function_ptr<void()> CallFinishedCb;
 void vk_call_api_items(PurpleConnection* gc, const char* method_name, const CallParams& params,
                        bool pagination, const CallProcessItemCb& call_process_item_cb,
-                       const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb);
+                       const CallFinishedCb& call_finished_cb, const CallErrorCb& error_cb,
+                       size_t max_parallel_pages = 1);
+
+// Priorities of API calls. Calls with lower values are sent first when several calls are waiting
+// for the rate limit. Priority is determined by the method name.
+enum VkCallPriority {
+    // Sending messages and marking them as read, everything user directly waits for.
+    VK_PRIORITY_USER_ACTION,
+    // Starting Long Poll and receiving missed messages.
+    VK_PRIORITY_LONG_POLL,
+    // Updating presence of buddies and self.
+    VK_PRIORITY_PRESENCE,
+    // Periodic updating of user, chat and group infos.
+    VK_PRIORITY_INFO,
+    // Everything else, which can wait.
+    VK_PRIORITY_BACKGROUND,
+
+    VK_NUM_CALL_PRIORITIES
+};
+
+// Statistics on API call scheduling for the connection.
+struct VkCallQueueStats
+{
+    // Number of calls currently waiting in queue for each priority.
+    size_t queue_size[VK_NUM_CALL_PRIORITIES];
+    // Maximum total number of waiting calls.
+    size_t max_queue_size;
+    // Number of sent calls.
+    uint64 calls_sent;
+    // Number of calls, which have waited in queue for the rate limit.
+    uint64 calls_delayed;
+    // Total and maximum time delayed calls have spent in queue.
+    steady_duration total_wait;
+    steady_duration max_wait;
+    // Number of "Too many requests per second" errors received despite scheduling.
+    uint64 rate_limit_errors;
+};
+const VkCallQueueStats& vk_call_queue_stats(PurpleConnection* gc);
+
+// Number of buckets in latency histograms. Bucket i counts durations less than 2^i milliseconds
+// (but not less than 2^(i-1)), the last bucket counts all the longer durations.
+const int VK_LATENCY_HISTOGRAM_SIZE = 14;
+
+// Statistics on calls to one API method. Calls to "execute" made by vk_call_api_batched are counted
+// both as "execute" and for each method in the batch, but only "execute" gets bytes and latencies.
+struct VkMethodStats
+{
+    // Number of calls sent, including retries.
+    uint64 calls;
+    // Number of calls, repeated after an error (re-authorization or rate limit).
+    uint64 retries;
+    // Number of calls, failed due to network or parsing errors.
+    uint64 network_errors;
+    // Number of errors, returned by Vk.com, by error code.
+    map<int, uint64> errors;
+    // Total size of requests (URL and body) and responses.
+    uint64 request_bytes;
+    uint64 response_bytes;
+    // Histograms of time spent in queue waiting for the rate limit and from sending the request
+    // till receiving the response.
+    uint64 queue_wait[VK_LATENCY_HISTOGRAM_SIZE];
+    uint64 latency[VK_LATENCY_HISTOGRAM_SIZE];
+};
+typedef map<string, VkMethodStats> VkMethodStatsMap;
+const VkMethodStatsMap& vk_call_method_stats(PurpleConnection* gc);
+
+// Returns human-readable multi-line description of all API and HTTP statistics for the connection.
+string vk_call_stats_to_string(PurpleConnection* gc);
@@ -1,4 +1,5 @@
 #include "httputils.h"
+#include "json-schema.h"
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-chat.h"
@@ -25,7 +26,7 @@ string make_education_string(const picojson::value& v)
         if (field_is_present<string>(v, "faculty_name"))
             ret = v.get("faculty_name").get<string>() +  ", " + ret;
         if (field_is_present<double>(v, "graduation")) {
-            int graduation = int(v.get("graduation").get<double>());
+            int graduation = json_int(v.get("graduation"));
             if (graduation != 0) {
                 ret += " ";
 
@@ -42,27 +43,61 @@ string make_education_string(const picojson::value& v)
     return ret;
 }
 
+// Fields of user object, returned by friends.get and users.get.
+struct UserFields
+{
+    uint64 id;
+    string first_name;
+    string last_name;
+    string deactivated;
+    string photo_50;
+    string activity;
+    string bdate;
+    string photo_max_orig;
+    string mobile_phone;
+    string domain;
+    bool online;
+    bool online_mobile;
+    const picojson::value* last_seen;
+};
+
+const JsonSchema<UserFields> user_fields_schema = {
+    json_field("id", &UserFields::id),
+    json_field("first_name", &UserFields::first_name),
+    json_field("last_name", &UserFields::last_name),
+    json_optional_field("deactivated", &UserFields::deactivated),
+    json_optional_field("photo_50", &UserFields::photo_50),
+    json_optional_field("activity", &UserFields::activity),
+    json_optional_field("bdate", &UserFields::bdate),
+    json_optional_field("photo_max_orig", &UserFields::photo_max_orig),
+    json_optional_field("mobile_phone", &UserFields::mobile_phone),
+    json_optional_field("domain", &UserFields::domain),
+    json_optional_field("online", &UserFields::online),
+    json_optional_field("online_mobile", &UserFields::online_mobile),
+    json_optional_field("last_seen", &UserFields::last_seen),
+};
+
 // Updates user info about user.
-void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
+void update_user_info_from(PurpleConnection* gc, const picojson::value& v)
 {
-    if (!field_is_present<double>(fields, "id")
-            || !field_is_present<string>(fields, "first_name")
-            || !field_is_present<string>(fields, "last_name")) {
-        vkcom_debug_error("Incomplete user information in friends.get or users.get: %s\n",
-                           picojson::value(fields).serialize().data());
+    UserFields fields = {};
+    string error;
+    if (!user_fields_schema.decode(v, fields, error)) {
+        vkcom_debug_error("Incomplete user information in friends.get or users.get (%s): %s\n",
+                          error.data(), v.serialize().data());
         return;
     }
-    uint64 user_id = fields.get("id").get<double>();
+    uint64 user_id = fields.id;
 
     VkUserInfo& info = get_data(gc).user_infos[user_id];
-    info.real_name = fields.get("first_name").get<string>() + " " + fields.get("last_name").get<string>();
+    info.real_name = fields.first_name + " " + fields.last_name;
 
     // This usually means that user has been deleted.
-    if (field_is_present<string>(fields, "deactivated"))
+    if (!fields.deactivated.empty())
         return;
 
-    if (field_is_present<string>(fields, "photo_50")) {
-        info.photo_min = fields.get("photo_50").get<string>();
+    if (!fields.photo_50.empty()) {
+        info.photo_min = fields.photo_50;
         static const char empty_photo_a[] = "http://vkontakte.ru/images/camera_a.gif";
         static const char empty_photo_b[] = "http://vkontakte.ru/images/camera_b.gif";
         static const char empty_photo_c[] = "https://vk.com/images/camera_c.gif";
@@ -71,40 +106,18 @@ void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
             info.photo_min.clear();
     }
 
-    if (field_is_present<string>(fields, "activity"))
-        info.activity = unescape_html(fields.get("activity").get<string>());
-    else
-        info.activity.clear();
-
-    if (field_is_present<string>(fields, "bdate"))
-        info.bdate = unescape_html(fields.get("bdate").get<string>());
-    else
-        info.bdate.clear();
-
-    info.education = unescape_html(make_education_string(fields));
-
-    if (field_is_present<string>(fields, "photo_max_orig"))
-        info.photo_max = fields.get("photo_max_orig").get<string>();
-    else
-        info.photo_max.clear();
-
-    if (field_is_present<string>(fields, "mobile_phone"))
-        info.mobile_phone = unescape_html(fields.get("mobile_phone").get<string>());
-    else
-        info.mobile_phone.clear();
+    info.activity = unescape_html(fields.activity);
+    info.bdate = unescape_html(fields.bdate);
+    info.education = unescape_html(make_education_string(v));
+    info.photo_max = fields.photo_max_orig;
+    info.mobile_phone = unescape_html(fields.mobile_phone);
 
-    if (field_is_present<string>(fields, "domain"))
-        info.domain = fields.get("domain").get<string>();
-    else
-        info.domain.clear();
+    info.domain = fields.domain;
     if (info.domain == user_name_from_id(user_id))
         info.domain.clear();
 
-    bool online = false;
-    if (field_is_present<double>(fields, "online"))
-        online = fields.get("online").get<double>() == 1;
-
-    bool online_mobile = field_is_present<double>(fields, "online_mobile");
+    bool online = fields.online;
+    bool online_mobile = fields.online_mobile;
 
     // Update presence only for non-friends.
     if (!is_user_friend(gc, user_id)) {
@@ -118,8 +131,8 @@ void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
                               info.online, info.online_mobile);
     }
 
-    if (field_is_present<picojson::object>(fields, "last_seen"))
-        info.last_seen = fields.get("last_seen").get("time").get<double>();
+    if (fields.last_seen && field_is_present<double>(*fields.last_seen, "time"))
+        info.last_seen = json_int(fields.last_seen->get("time"));
 }
 
 // Returns all "id" elements from each item in items.
@@ -135,7 +148,7 @@ set<uint64> get_ids_from_items(const picojson::array& items)
             vkcom_debug_error("Strange response: %s\n", it.serialize().data());
             return set<uint64>();
         }
-        uint64 id = it.get("id").get<double>();
+        uint64 id = json_int(it.get("id"));
         ret.insert(id);
     }
     return ret;
@@ -146,7 +159,7 @@ void update_friends_info(PurpleConnection* gc, const SuccessCb& success_cb)
 {
     CallParams params = { {"user_id", to_string(get_data(gc).self_user_id())},
                           {"fields", user_fields} };
-    vk_call_api(gc, "friends.get", params, [=](const picojson::value& result) {
+    vk_call_api_batched(gc, "friends.get", params, [=](const picojson::value& result) {
         if (!result.is<picojson::object>()) {
             vkcom_debug_error("Strange response from friends.get: %s\n", result.serialize().data());
             purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
@@ -190,13 +203,34 @@ struct GetUsersChatsData
 };
 typedef shared_ptr<GetUsersChatsData> GetUsersChatsData_ptr;
 
+// Fields of the last message in a dialog, returned by messages.getDialogs.
+struct DialogMessageFields
+{
+    uint64 user_id;
+    uint64 chat_id;
+    string title;
+    const picojson::array* chat_active;
+    uint64 admin_id;
+};
+
+const JsonSchema<DialogMessageFields> chat_dialog_schema = {
+    json_field("chat_id", &DialogMessageFields::chat_id),
+    json_field("title", &DialogMessageFields::title),
+    json_field("chat_active", &DialogMessageFields::chat_active),
+    json_field("admin_id", &DialogMessageFields::admin_id),
+};
+
+const JsonSchema<DialogMessageFields> user_dialog_schema = {
+    json_field("user_id", &DialogMessageFields::user_id),
+};
+
 void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& success_cb,
                                        const GetUsersChatsData_ptr& data, size_t offset)
 {
     CallParams params = { {"count", "200"},
                           {"offset", to_string(offset)},
                           {"preview_length", "1"} };
-    vk_call_api(gc, "messages.getDialogs", params, [=](const picojson::value& v) {
+    vk_call_api_batched(gc, "messages.getDialogs", params, [=](const picojson::value& v) {
         if (!field_is_present<double>(v, "count")
                 || !field_is_present<picojson::array>(v, "items")) {
             vkcom_debug_error("Strange response from messages.getDialogs: %s\n",
@@ -208,7 +242,7 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
 
         VkData& gc_data = get_data(gc);
 
-        uint64 count = v.get("count").get<double>();
+        uint64 count = json_int(v.get("count"));
         const picojson::array& items = v.get("items").get<picojson::array>();
         for (const picojson::value& m: items) {
             if (!field_is_present<picojson::object>(m, "message")) {
@@ -219,40 +253,32 @@ void get_users_chats_from_dialogs_impl(PurpleConnection* gc, const SuccessCb& su
                 return;
             }
 
+            // Dialogs with chats have chat_id, dialogs with users have only user_id.
             const picojson::value& message = m.get("message");
-            if (field_is_present<double>(message, "chat_id")) {
-                if (!field_is_present<string>(message, "title")
-                        || !field_is_present<picojson::array>(message, "chat_active")
-                        || !field_is_present<double>(message, "admin_id")) {
-                    vkcom_debug_error("Strange response from our getDialogs: %s\n",
-                                      v.serialize().data());
-                    purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                                                   i18n("Unable to retrieve dialogs list"));
-                    return;
-                }
+            bool is_chat = field_is_present<double>(message, "chat_id");
+            DialogMessageFields fields = {};
+            string error;
+            const JsonSchema<DialogMessageFields>& schema = is_chat ? chat_dialog_schema
+                                                                    : user_dialog_schema;
+            if (!schema.decode(message, fields, error)) {
+                vkcom_debug_error("Strange response from messages.getDialogs (%s): %s\n",
+                                  error.data(), v.serialize().data());
+                purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                                               i18n("Unable to retrieve dialogs list"));
+                return;
+            }
 
+            if (is_chat) {
                 // If there are no chat participants, chat is inactive, ignore it (messages.getChat
                 // returns an error in these cases).
-                const picojson::array& chat_active = message.get("chat_active")
-                                                            .get<picojson::array>();
-                if (chat_active.size() == 0)
+                if (fields.chat_active->size() == 0)
                     continue;
 
                 // NOTE: we could parse chat title and participants and add entries to chat_infos,
                 // but it's easier to do it via update_chat_infos.
-                uint64 chat_id = message.get("chat_id").get<double>();
-                data->chat_ids.insert(chat_id);
+                data->chat_ids.insert(fields.chat_id);
             } else {
-                if (!field_is_present<double>(message, "user_id")) {
-                    vkcom_debug_error("Strange response from messages.getDialogs: %s\n",
-                                      v.serialize().data());
-                    purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                                                   i18n("Unable to retrieve dialogs list"));
-                    return;
-                }
-
-                uint64 user_id = message.get("user_id").get<double>();
-                data->user_ids.insert(user_id);
+                data->user_ids.insert(fields.user_id);
             }
         }
 
@@ -725,38 +751,50 @@ void update_blist(PurpleConnection* gc)
 void update_user_chat_infos(PurpleConnection* gc)
 {
     vkcom_debug_info("Updating full users and chats information\n");
+    steady_time_point start_time = steady_clock::now();
+
+    // friends.get and messages.getDialogs are independent, so we request them simultaneously
+    // (they get sent in one batch) and continue when both have finished.
+    shared_ptr<int> remaining{ new int(2) };
+    SuccessCb both_finished_cb = [=] {
+        (*remaining)--;
+        if (*remaining > 0)
+            return;
 
-    update_friends_info(gc, [=] {
-        get_users_chats_from_dialogs(gc, [=]() {
-            VkData& gc_data = get_data(gc);
-            set<uint64> non_friend_user_ids;
-            // Do not update user infos if we will not show users in blist anyway.
-            if (!gc_data.options().only_friends_in_blist) {
-                insert_if(non_friend_user_ids, gc_data.dialog_user_ids, [=](uint64 user_id) {
-                    return !is_user_friend(gc, user_id);
-                });
-            }
-
-            insert_if(non_friend_user_ids, gc_data.manually_added_buddies(), [=](uint64 user_id) {
+        VkData& gc_data = get_data(gc);
+        set<uint64> non_friend_user_ids;
+        // Do not update user infos if we will not show users in blist anyway.
+        if (!gc_data.options().only_friends_in_blist) {
+            insert_if(non_friend_user_ids, gc_data.dialog_user_ids, [=](uint64 user_id) {
                 return !is_user_friend(gc, user_id);
             });
+        }
 
-            update_user_infos(gc, non_friend_user_ids, [=] {
-                update_chat_infos(gc, get_data(gc).chat_ids, [=] {
-                    update_blist(gc);
+        insert_if(non_friend_user_ids, gc_data.manually_added_buddies(), [=](uint64 user_id) {
+            return !is_user_friend(gc, user_id);
+        });
 
-                    // Chat titles, participants or buddy aliases could've changed.
-                    update_all_open_chat_convs(gc);
-                });
+        update_user_infos(gc, non_friend_user_ids, [=] {
+            update_chat_infos(gc, get_data(gc).chat_ids, [=] {
+                update_blist(gc);
+
+                // Chat titles, participants or buddy aliases could've changed.
+                update_all_open_chat_convs(gc);
+
+                vkcom_debug_info("Users and chats information updated in %lldms\n",
+                                 (long long)to_milliseconds(steady_clock::now() - start_time));
             });
         });
-    });
+    };
+
+    update_friends_info(gc, both_finished_cb);
+    get_users_chats_from_dialogs(gc, both_finished_cb);
 }
 
 void update_friends_presence(PurpleConnection* gc, const SuccessCb& on_update_cb)
 {
     CallParams params = { {"online_mobile", "1"} };
-    vk_call_api(gc, "friends.getOnline", params, [=](const picojson::value& result) {
+    vk_call_api_batched(gc, "friends.getOnline", params, [=](const picojson::value& result) {
         if (!field_is_present<picojson::array>(result, "online")
                 || !field_is_present<picojson::array>(result, "online_mobile")) {
             vkcom_debug_error("Strange response from friends.getOnline: %s\n",
@@ -779,7 +817,7 @@ void update_friends_presence(PurpleConnection* gc, const SuccessCb& on_update_cb
                 return;
             }
 
-            uint64 user_id = v.get<double>();
+            uint64 user_id = json_int(v);
             friend_user_ids.insert(user_id);
             VkUserInfo& info = gc_data.user_infos[user_id];
             if (info.online && !info.online_mobile)
@@ -800,7 +838,7 @@ void update_friends_presence(PurpleConnection* gc, const SuccessCb& on_update_cb
                 return;
             }
 
-            uint64 user_id = v.get<double>();
+            uint64 user_id = json_int(v);
             friend_user_ids.insert(user_id);
             VkUserInfo& info = gc_data.user_infos[user_id];
             if (info.online && info.online_mobile)
@@ -839,7 +877,7 @@ void update_open_conv_presence(PurpleConnection *gc)
 
     CallParams params = { {"fields", "online,online_mobile"},
                           {"user_ids", str_concat_int(',', user_ids)} };
-    vk_call_api(gc, "users.get", params, [=](const picojson::value& result) {
+    vk_call_api_batched(gc, "users.get", params, [=](const picojson::value& result) {
         if (!result.is<picojson::array>()) {
             vkcom_debug_error("Strange response from users.get: %s\n", result.serialize().data());
             return;
@@ -856,8 +894,8 @@ void update_open_conv_presence(PurpleConnection *gc)
                                    v.serialize().data());
                 continue;
             }
-            uint64 user_id = v.get("id").get<double>();
-            bool online = v.get("online").get<double>() == 1;
+            uint64 user_id = json_int(v.get("id"));
+            bool online = json_int(v.get("online")) == 1;
             bool online_mobile = field_is_present<double>(v, "online_mobile");
             vkcom_debug_info("Got status %d, %d for %llu\n", online, online_mobile,
                              (unsigned long long)user_id);
@@ -876,20 +914,71 @@ void update_open_conv_presence(PurpleConnection *gc)
     }, nullptr);
 }
 
-void update_user_infos(PurpleConnection* gc, const set<uint64>& user_ids, const SuccessCb& on_update_cb)
+namespace
 {
-    if (user_ids.empty()) {
-        if (on_update_cb)
+
+// Calls fetch_cb only for ids, which are not being fetched already, and attaches to the running
+// requests for the other ids. on_update_cb is called after all ids have been fetched.
+typedef function_ptr<void(const set<uint64>& ids, const SuccessCb& finished_cb)> FetchIdsCb;
+void fetch_ids_once(VkInFlightIds& in_flight, const set<uint64>& ids, const FetchIdsCb& fetch_cb,
+                    const SuccessCb& on_update_cb)
+{
+    set<shared_ptr<VkInFlightRequest>> pending_requests;
+    set<uint64> new_ids;
+    for (uint64 id: ids) {
+        auto it = in_flight.find(id);
+        if (it != in_flight.end())
+            pending_requests.insert(it->second);
+        else
+            new_ids.insert(id);
+    }
+
+    if (!pending_requests.empty())
+        vkcom_debug_info("%d ids are already being fetched, waiting for %d requests\n",
+                         int(ids.size() - new_ids.size()), (int)pending_requests.size());
+
+    shared_ptr<size_t> remaining{ new size_t(pending_requests.size() + (new_ids.empty() ? 0 : 1)) };
+    SuccessCb finished_cb = [=] {
+        (*remaining)--;
+        if (*remaining == 0 && on_update_cb)
             on_update_cb();
+    };
+
+    for (const shared_ptr<VkInFlightRequest>& request: pending_requests)
+        request->waiters.push_back(finished_cb);
+
+    if (new_ids.empty())
         return;
-    }
 
+    shared_ptr<VkInFlightRequest> request{ new VkInFlightRequest() };
+    request->waiters.push_back(finished_cb);
+    for (uint64 id: new_ids)
+        in_flight[id] = request;
+
+    // VkData outlives all the API calls, so storing pointer is safe.
+    VkInFlightIds* in_flight_ptr = &in_flight;
+    fetch_cb(new_ids, [=] {
+        for (uint64 id: new_ids) {
+            auto it = in_flight_ptr->find(id);
+            if (it != in_flight_ptr->end() && it->second == request)
+                in_flight_ptr->erase(it);
+        }
+
+        vector<SuccessCb> waiters;
+        waiters.swap(request->waiters);
+        for (const SuccessCb& waiter: waiters)
+            waiter();
+    });
+}
+
+void update_user_infos_impl(PurpleConnection* gc, const set<uint64>& user_ids, const SuccessCb& on_update_cb)
+{
     string user_ids_str = str_concat_int(',', user_ids);
     vkcom_debug_info("Updating information on buddies %s\n", user_ids_str.data());
 
     CallParams params = { {"fields", user_fields},
                           {"user_ids", str_concat_int(',', user_ids)} };
-    vk_call_api(gc, "users.get", params, [=](const picojson::value& result) {
+    vk_call_api_batched(gc, "users.get", params, [=](const picojson::value& result) {
         if (!result.is<picojson::array>()) {
             vkcom_debug_error("Strange response from users.get: %s\n", result.serialize().data());
             purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
@@ -916,33 +1005,46 @@ void update_user_infos(PurpleConnection* gc, const set<uint64>& user_ids, const
     });
 }
 
-namespace
+// Fields of chat object, returned by messages.getChat.
+struct ChatFields
 {
+    uint64 id;
+    string title;
+    uint64 admin_id;
+    const picojson::array* users;
+};
+
+const JsonSchema<ChatFields> chat_fields_schema = {
+    json_field("id", &ChatFields::id),
+    json_field("title", &ChatFields::title),
+    json_field("admin_id", &ChatFields::admin_id),
+    json_field("users", &ChatFields::users),
+};
 
 // Updates one entry in chat_infos. update_blist has the same meaning as in update_chat_infos
 void update_chat_info_from(PurpleConnection* gc, const picojson::value& chat,
                            bool update_blist = false)
 {
-    if (!field_is_present<double>(chat, "id") || !field_is_present<string>(chat, "title")
-            || !field_is_present<double>(chat, "admin_id")
-            || !field_is_present<picojson::array>(chat, "users")) {
-        vkcom_debug_error("Strange response from messages.getChat: %s\n", chat.serialize().data());
+    ChatFields fields = {};
+    string error;
+    if (!chat_fields_schema.decode(chat, fields, error)) {
+        vkcom_debug_error("Strange response from messages.getChat (%s): %s\n", error.data(),
+                          chat.serialize().data());
         purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        i18n("Unable to retrieve chat info"));
         return;
     }
 
-    uint64 chat_id = chat.get("id").get<double>();
+    uint64 chat_id = fields.id;
     VkData& gc_data = get_data(gc);
     VkChatInfo& info = gc_data.chat_infos[chat_id];
-    info.admin_id = chat.get("admin_id").get<double>();
-    info.title = chat.get("title").get<string>();
+    info.admin_id = fields.admin_id;
+    info.title = fields.title;
 
     info.participants.clear();
     set<string> already_used_names;
 
-    const picojson::array& users = chat.get("users").get<picojson::array>();
-    for (const picojson::value& u: users) {
+    for (const picojson::value& u: *fields.users) {
         if (!field_is_present<double>(u, "id")) {
             vkcom_debug_error("Strange response from messages.getChat: %s\n",
                               chat.serialize().data());
@@ -952,7 +1054,7 @@ void update_chat_info_from(PurpleConnection* gc, const picojson::value& chat,
         }
 
         // E-mail participants are less than zero, let's just ignore them. Also, ignore the user.
-        int64 user_id = u.get("id").get<double>();
+        int64 user_id = json_int(u.get("id"));
         if (user_id < 0 || gc_data.self_user_id() == (uint64)user_id)
             continue;
 
@@ -980,23 +1082,15 @@ void update_chat_info_from(PurpleConnection* gc, const picojson::value& chat,
         update_open_chat_conv(gc, conv_id);
 }
 
-} // namespace
-
-void update_chat_infos(PurpleConnection* gc, const set<uint64>& chat_ids,
-                       const SuccessCb& on_update_cb, bool update_blist)
+void update_chat_infos_impl(PurpleConnection* gc, const set<uint64>& chat_ids,
+                            const SuccessCb& on_update_cb, bool update_blist)
 {
-    if (chat_ids.empty()) {
-        if (on_update_cb)
-            on_update_cb();
-        return;
-    }
-
     string chat_ids_str = str_concat_int(',', chat_ids);
     vkcom_debug_info("Updating information on chats %s\n", chat_ids_str.data());
 
     CallParams params = { {"fields", user_fields},
                           {"chat_ids", str_concat_int(',', chat_ids)} };
-    vk_call_api(gc, "messages.getChat", params, [=](const picojson::value& v) {
+    vk_call_api_batched(gc, "messages.getChat", params, [=](const picojson::value& v) {
         if (!v.is<picojson::array>()) {
             vkcom_debug_error("Strange response from messages.getChat: %s\n", v.serialize().data());
             purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
@@ -1017,6 +1111,55 @@ void update_chat_infos(PurpleConnection* gc, const set<uint64>& chat_ids,
     });
 }
 
+} // namespace
+
+void update_user_infos(PurpleConnection* gc, const set<uint64>& user_ids, const SuccessCb& on_update_cb)
+{
+    if (user_ids.empty()) {
+        if (on_update_cb)
+            on_update_cb();
+        return;
+    }
+
+    fetch_ids_once(get_data(gc).users_in_flight, user_ids, [=](const set<uint64>& new_ids,
+                                                               const SuccessCb& finished_cb) {
+        update_user_infos_impl(gc, new_ids, finished_cb);
+    }, on_update_cb);
+}
+
+void update_chat_infos(PurpleConnection* gc, const set<uint64>& chat_ids,
+                       const SuccessCb& on_update_cb, bool update_blist)
+{
+    if (chat_ids.empty()) {
+        if (on_update_cb)
+            on_update_cb();
+        return;
+    }
+
+    VkData& gc_data = get_data(gc);
+    set<uint64> pending_chat_ids;
+    insert_if(pending_chat_ids, chat_ids, [&](uint64 chat_id) {
+        return contains(gc_data.chats_in_flight, chat_id);
+    });
+
+    fetch_ids_once(gc_data.chats_in_flight, chat_ids, [=](const set<uint64>& new_ids,
+                                                          const SuccessCb& finished_cb) {
+        update_chat_infos_impl(gc, new_ids, finished_cb, update_blist);
+    }, [=] {
+        // Running requests could have been started without update_blist.
+        if (update_blist) {
+            for (uint64 chat_id: pending_chat_ids) {
+                VkChatInfo* info = get_chat_info(gc, chat_id);
+                if (info && chat_should_be_in_blist(gc, chat_id))
+                    update_blist_chat(gc, chat_id, *info);
+            }
+        }
+
+        if (on_update_cb)
+            on_update_cb();
+    });
+}
+
 
 void update_presence_in_blist(PurpleConnection *gc, uint64 user_id)
 {
@@ -1,3 +1,4 @@
+#include "miscutils.h"
 #include "vk-api.h"
 #include "vk-buddy.h"
 #include "vk-common.h"
@@ -250,7 +251,7 @@ void add_user_to_chat(PurpleConnection* gc, uint64 chat_id, uint64 user_id)
             return;
         }
 
-        if (result.get<double>() != 1.0) {
+        if (json_int(result) != 1) {
             show_add_user_error(gc, chat_id, user_id);
             return;
         }
@@ -275,7 +276,7 @@ void remove_user_from_chat(PurpleConnection* gc, uint64 chat_id, uint64 user_id)
             return;
         }
 
-        if (result.get<double>() != 1.0) {
+        if (json_int(result) != 1) {
             show_remove_user_error(gc, chat_id, user_id);
             return;
         }
@@ -303,7 +304,7 @@ void set_chat_title(PurpleConnection* gc, uint64 chat_id, const char* title)
             return;
         }
 
-        if (result.get<double>() != 1.0) {
+        if (json_int(result) != 1) {
             show_set_title_error(gc, chat_id);
             return;
         }
@@ -45,9 +45,9 @@ vector<VkReceivedMessage> deferred_mark_as_read_from_string(const char* str)
     const picojson::array& a = v.get<picojson::array>();
     for (const picojson::value& d: a) {
         VkReceivedMessage msg;
-        msg.msg_id = d.get("msg_id").get<double>();
-        msg.user_id = d.get("user_id").get<double>();
-        msg.chat_id = d.get("chat_id").get<double>();
+        msg.msg_id = json_int(d.get("msg_id"));
+        msg.user_id = json_int(d.get("user_id"));
+        msg.chat_id = json_int(d.get("chat_id"));
         messages.push_back(std::move(msg));
     }
 
@@ -64,9 +64,9 @@ string deferred_mark_as_read_to_string(const vector<VkReceivedMessage>& messages
     picojson::array a;
     for (const VkReceivedMessage& msg: messages) {
         picojson::object d = {
-            {"msg_id",  picojson::value((double)msg.msg_id)},
-            {"user_id", picojson::value((double)msg.user_id)},
-            {"chat_id", picojson::value((double)msg.chat_id)},
+            {"msg_id",  picojson::value((int64_t)msg.msg_id)},
+            {"user_id", picojson::value((int64_t)msg.user_id)},
+            {"chat_id", picojson::value((int64_t)msg.chat_id)},
         };
         a.push_back(picojson::value(d));
     }
@@ -93,10 +93,10 @@ map<uint64, VkUploadedDocInfo> uploaded_docs_from_string(const char* str)
                 || !field_is_present<string>(d, "url"))
             continue;
 
-        uint64 id = d.get("id").get<double>();
+        uint64 id = json_int(d.get("id"));
         VkUploadedDocInfo& doc = docs[id];
         doc.filename = d.get("filename").get<string>();
-        doc.size = d.get("size").get<double>();
+        doc.size = json_int(d.get("size"));
         doc.md5sum = d.get("md5sum").get<string>();
         doc.url = d.get("url").get<string>();
     }
@@ -111,9 +111,9 @@ string uploaded_docs_to_string(const map<uint64, VkUploadedDocInfo>& docs)
         uint64 id = p.first;
         const VkUploadedDocInfo& doc = p.second;
         picojson::object d = {
-            {"id",  picojson::value((double)id)},
+            {"id",  picojson::value((int64_t)id)},
             {"filename", picojson::value(doc.filename)},
-            {"size", picojson::value((double)doc.size)},
+            {"size", picojson::value((int64_t)doc.size)},
             {"md5sum", picojson::value(doc.md5sum)},
             {"url", picojson::value(doc.url)}
         };
@@ -149,11 +149,52 @@ bool check_if_webkit_enabled()
     return true;
 }
 
+// Replaces values of all string fields with the given name in JSON text with replacement.
+void redact_json_field(string& text, const char* name, const char* replacement)
+{
+    string quoted_name = str_format("\"%s\"", name);
+    size_t pos = 0;
+    while ((pos = text.find(quoted_name, pos)) != string::npos) {
+        pos += quoted_name.size();
+        size_t value_start = text.find_first_not_of(" \t\r\n", pos);
+        if (value_start == string::npos || text[value_start] != ':')
+            continue;
+        value_start = text.find_first_not_of(" \t\r\n", value_start + 1);
+        if (value_start == string::npos || text[value_start] != '"')
+            continue;
+        value_start++;
+
+        // Skip escaped characters, including quotes.
+        size_t value_end = value_start;
+        while (value_end < text.size() && text[value_end] != '"')
+            value_end += text[value_end] == '\\' ? 2 : 1;
+        if (value_end >= text.size())
+            return;
+
+        text.replace(value_start, value_end - value_start, replacement);
+        pos = value_start + strlen(replacement) + 1;
+    }
+}
+
 } // End of anonymous namespace
 
 VkData::VkData(PurpleConnection* gc, const string& email, const string& password)
-    : m_email(email),
+    : network_available(true),
+      network_down_count(0),
+      long_poll_request_id(0),
+      long_poll_connection(nullptr),
+      long_poll_wait(0),
+      long_poll_max_wait(0),
+      unsaved_last_msg_id(0),
+      unsaved_long_poll_ts(0),
+      unsaved_long_poll_pts(0),
+      http_stats(),
+      processing_stats(),
+      login_time(steady_clock::now()),
+      m_email(email),
       m_password(password),
+      m_auth_in_progress(false),
+      m_echo_sweep_scheduled(false),
       m_gc(gc),
       m_closing(false),
       m_keepalive_pool(nullptr)
@@ -245,10 +286,16 @@ void VkData::authenticate(const SuccessCb& success_cb, const ErrorCb& error_cb)
         return;
     }
 
+    m_auth_waiters.emplace_back(success_cb, error_cb);
+    if (m_auth_in_progress) {
+        vkcom_debug_info("Authentication already in progress, waiting for it to finish\n");
+        return;
+    }
+    m_auth_in_progress = true;
+
     vk_auth_user(m_gc, m_email, m_password, VK_CLIENT_ID, VK_PERMISSIONS,
                  m_options.imitate_mobile_client,
         [=](const string& access_token, const string& self_user_id) {
-            m_access_token = access_token;
             try {
                 m_self_user_id = atoll(self_user_id.data());
 #if defined(__GNUC__) && !defined(__clang__)
@@ -263,14 +310,61 @@ void VkData::authenticate(const SuccessCb& success_cb, const ErrorCb& error_cb)
                 vkcom_debug_error("Error converting user id %s to integer\n", self_user_id.data());
                 purple_connection_error_reason(m_gc, PURPLE_CONNECTION_ERROR_OTHER_ERROR,
                                                i18n("Authentication process failed"));
-                error_cb();
+                finish_authentication(false);
+                return;
             }
-            success_cb();
+            m_access_token = access_token;
+            finish_authentication(true);
     }, [=] {
         vkcom_debug_error("Unable to authenticate, connection will be terminated\n");
         purple_connection_error_reason(m_gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                                        i18n("Unable to connect to Long Poll server"));
-        error_cb();
+        finish_authentication(false);
+    });
+}
+
+void VkData::finish_authentication(bool success)
+{
+    m_auth_in_progress = false;
+
+    // Callbacks may start new authentication, so we move the waiters out first.
+    vector<pair<SuccessCb, ErrorCb>> waiters;
+    waiters.swap(m_auth_waiters);
+    vkcom_debug_info("Authentication finished, %d callbacks waiting\n", (int)waiters.size());
+    for (const pair<SuccessCb, ErrorCb>& waiter: waiters) {
+        if (success && waiter.first)
+            waiter.first();
+        else if (!success && waiter.second)
+            waiter.second();
+    }
+}
+
+void VkData::add_pending_echo(uint64 msg_id, steady_duration timeout, const SuccessCb& process_cb)
+{
+    m_pending_echoes.push_back({ msg_id, steady_clock::now() + timeout, process_cb });
+    if (!m_echo_sweep_scheduled)
+        sweep_pending_echoes();
+}
+
+void VkData::sweep_pending_echoes()
+{
+    steady_time_point now = steady_clock::now();
+    while (!m_pending_echoes.empty() && m_pending_echoes.front().deadline <= now) {
+        SuccessCb process_cb = m_pending_echoes.front().process_cb;
+        m_pending_echoes.pop_front();
+        process_cb();
+    }
+
+    m_echo_sweep_scheduled = !m_pending_echoes.empty();
+    if (!m_echo_sweep_scheduled)
+        return;
+
+    // Echoes could have been removed by add_sent_msg_id since the timer has been added, in this
+    // case the sweep does nothing but schedules the timer for the next deadline.
+    PurpleConnection* gc = m_gc;
+    timeout_add(gc, to_milliseconds(m_pending_echoes.front().deadline - now) + 1, [=] {
+        get_data(gc).sweep_pending_echoes();
+        return false;
     });
 }
 
@@ -353,3 +447,36 @@ void timeout_add(PurpleConnection* gc, unsigned milliseconds, const TimeoutCb& c
 
     gc_data.timeout_ids.insert(data->id);
 }
+
+void capture_response(PurpleConnection* gc, const string& source, const char* response_text)
+{
+    static FILE* capture_file = nullptr;
+    static bool capture_file_opened = false;
+    if (!capture_file_opened) {
+        capture_file_opened = true;
+        const char* capture_path = g_getenv("VKCOM_CAPTURE_FILE");
+        if (capture_path) {
+            capture_file = fopen(capture_path, "a");
+            if (!capture_file)
+                vkcom_debug_error("Unable to open capture file %s\n", capture_path);
+        }
+    }
+    if (!capture_file)
+        return;
+
+    // One response per line: milliseconds since login, source and the response itself.
+    // Newlines may occur in JSON only as whitespace, so replacing them with spaces keeps each
+    // response valid JSON on a single line.
+    VkData& gc_data = get_data(gc);
+    string text = response_text;
+    if (!gc_data.access_token().empty())
+        str_replace(text, gc_data.access_token(), "XXX-ACCESS-TOKEN-XXX");
+    // Long Poll key (messages.getLongPollServer) and upload server addresses grant access
+    // to the account the same way the token does.
+    redact_json_field(text, "key", "XXX-KEY-XXX");
+    redact_json_field(text, "upload_url", "XXX-UPLOAD-URL-XXX");
+    str_replace(text, "\n", " ");
+    fprintf(capture_file, "%lld\t%s\t%s\n", (long long)to_milliseconds(steady_clock::now() - gc_data.login_time),
+            source.data(), text.data());
+    fflush(capture_file);
+}
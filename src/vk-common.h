@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <set>
 
@@ -121,6 +123,51 @@ struct VkBlistNode
     string group;
 };
 
+// One API call, waiting to be sent. See vk_call_api_batched for more info.
+struct VkBatchedCall;
+// Queue of API calls, waiting for the rate limit. See vk-api.cpp for more info.
+struct VkCallQueue;
+
+// Statistics on all HTTP requests (API calls, Long Poll, downloads) made by http_request.
+struct VkHttpStats
+{
+    // Number of requests, including retries.
+    uint64 requests;
+    // Number of requests, repeated due to network errors or 5xx server errors.
+    uint64 retries;
+    // Number of requests, which have failed after all the retries.
+    uint64 failed;
+    // Total size of response bodies.
+    uint64 response_bytes;
+};
+
+// Statistics on processing of the received data: the number of processed items and the time spent
+// in each stage.
+struct VkProcessingStats
+{
+    // Parsing of API and Long Poll responses.
+    uint64 parsed_responses;
+    steady_duration parse_time;
+    // Processing of Long Poll updates, including the updates from messages.getLongPollHistory.
+    uint64 long_poll_updates;
+    steady_duration long_poll_time;
+    // Decoding of message objects from messages.get and messages.getById.
+    uint64 decoded_messages;
+    steady_duration decode_time;
+    // Writing of the decoded messages to conversations and logs.
+    uint64 written_messages;
+    steady_duration write_time;
+};
+
+// A request for user or chat infos, which is currently running. Contains callbacks, which must be
+// called upon its completion.
+struct VkInFlightRequest
+{
+    vector<SuccessCb> waiters;
+};
+// Map from user or chat id to the running request, which fetches info on it.
+typedef map<uint64, shared_ptr<VkInFlightRequest>> VkInFlightIds;
+
 // All timed events must be added via this timeout_add, because only then they will be properly
 // destroyed upon closing connection.
 typedef function_ptr<bool()> TimeoutCb;
@@ -139,7 +186,8 @@ public:
 
     // Perform authentication. access_token is set upon successful authentication.
     // Authentication is performed only if access_token is empty, otherwise
-    // success_cb is called immediately.
+    // success_cb is called immediately. If authentication is already in progress, callbacks
+    // are called when it finishes.
     void authenticate(const SuccessCb& success_cb, const ErrorCb &error_cb);
 
     // Access token, used for accessing the API.
@@ -189,6 +237,11 @@ public:
     // updated only when info is re-requested and is stale.
     map<uint64, VkGroupInfo> group_infos;
 
+    // Users and chats, which infos are currently being requested by update_user_infos and
+    // update_chat_infos. Used to avoid requesting the same infos several times simultaneously.
+    VkInFlightIds users_in_flight;
+    VkInFlightIds chats_in_flight;
+
     // There is a problem with processing outgoing messages: either they are sent by us and need no further
     // processing, or they are sent by some other client (or from website) and we need to at least append
     // them to log. We can potentially receive response from messages.send *after* longpoll informs us
@@ -198,18 +251,30 @@ public:
     // 2) The returned mid from messages.send call is stored in m_sent_msg_ids.
     // 3) When longpoll processes outgoing message with given mid, it checks m_sent_msg_ids if the message
     //    has been sent by us. If received mid is not present in m_sent_msg_ids, it checks if the last message
-    //    has been sent by us earlier then 1 second. If it has not, after a 5 second timeout m_sent_msg_ids
-    //    is checked again (hopefully, by that time messages.send would have returned a message and the desured
-    //    mid will be in m_sent_msg_ids).
+    //    has been sent by us recently. If it has, the message is added to m_pending_echoes. If messages.send
+    //    returns the same mid later, the message is dropped from m_pending_echoes in add_sent_msg_id,
+    //    otherwise it is processed by the periodic sweep after a timeout.
     //
     // We only to *locally* sent messages.
 
     // Adds sent msg id. Must be used when sending the message succeeds and we get the msg id.
     void add_sent_msg_id(uint64 msg_id)
     {
+        // Long Poll has already returned this message, now we know it is ours.
+        auto it = std::find_if(m_pending_echoes.begin(), m_pending_echoes.end(),
+                               [=](const PendingEcho& echo) { return echo.msg_id == msg_id; });
+        if (it != m_pending_echoes.end()) {
+            m_pending_echoes.erase(it);
+            return;
+        }
         m_sent_msg_ids.insert(msg_id);
     }
 
+    // Adds outgoing message from Long Poll, which may have been sent by us. process_cb is called after
+    // timeout unless add_sent_msg_id is called with msg_id before that. All messages must be added
+    // with the same timeout.
+    void add_pending_echo(uint64 msg_id, steady_duration timeout, const SuccessCb& process_cb);
+
     // Checks if msg_id has been sent and removes it from the list of sent msg ids. Returns false
     // if msg_id had not been sent, true otherwise.
     bool remove_sent_msg_id(uint64 msg_id)
@@ -307,6 +372,51 @@ public:
     // This container should be changed into bimap.
     vector<pair<int, uint64>> chat_conv_ids;
 
+    // API calls, which will be sent in one "execute" call. See vk_call_api_batched.
+    vector<shared_ptr<VkBatchedCall>> batched_calls;
+
+    // False while GNetworkMonitor reports that the network is unavailable. Long Poll and periodic
+    // updates are paused meanwhile, see network_changed in vk-plugin.cpp.
+    bool network_available;
+    // Incremented each time the network becomes unavailable, so that requests can tell whether
+    // the network has gone down while they were in progress.
+    uint64 network_down_count;
+    // Continues Long Poll, which has been suspended due to unavailable network, empty if Long Poll
+    // is running. See resume_long_poll.
+    SuccessCb suspended_long_poll;
+    // The id of the Long Poll request in progress. It changes once the request completes or gets
+    // restarted by resume_long_poll, so that the callback of the cancelled request does nothing.
+    uint64 long_poll_request_id;
+    // The connection of the Long Poll request in progress, nullptr if there is none, and
+    // the function, which sends the same request again. See resume_long_poll.
+    PurpleHttpConnection* long_poll_connection;
+    SuccessCb restart_long_poll;
+
+    // Current and the largest tolerated value of "wait" parameter of Long Poll requests in seconds,
+    // zero until the first request. See get_long_poll_wait in vk-longpoll.cpp.
+    int long_poll_wait;
+    int long_poll_max_wait;
+
+    // Ids of messages, which will be received in one call. See receive_messages_batched.
+    vector<uint64> batched_message_ids;
+
+    // The id of the last processed message and Long Poll position, which have not been saved
+    // to account settings yet, zero if there are none. See save_last_msg_id and
+    // save_long_poll_position in vk-longpoll.cpp.
+    uint64 unsaved_last_msg_id;
+    uint64 unsaved_long_poll_ts;
+    uint64 unsaved_long_poll_pts;
+
+    // API calls, waiting to be sent due to the rate limit. Created upon first API call.
+    shared_ptr<VkCallQueue> call_queue;
+
+    // Statistics on HTTP requests. See vk_call_stats_to_string.
+    VkHttpStats http_stats;
+    // Statistics on processing of the received data. See vk_call_stats_to_string.
+    VkProcessingStats processing_stats;
+    // Time, when the connection has been opened.
+    steady_time_point login_time;
+
     // If true, connection is in "closing" state. This is set in vk_close and is used in longpoll
     // callback to differentiate the case of network timeout/silent connection dropping and connection
     // cancellation.
@@ -320,8 +430,8 @@ public:
         m_closing = true;
     }
 
-    // Returns true if authentication is in process (try requesting access token after
-    // a while).
+    // Returns true if authentication is in process (call authenticate to wait until
+    // it finishes).
     bool is_authenticating() const
     {
         return m_access_token.empty();
@@ -332,14 +442,33 @@ public:
     PurpleHttpKeepalivePool* get_keepalive_pool();
 
 private:
+    // Calls callbacks of everyone who waited for authentication.
+    void finish_authentication(bool success);
+    // Processes all pending echoes, which have timed out, and schedules the next sweep.
+    void sweep_pending_echoes();
+
     string m_email;
     string m_password;
     string m_access_token;
     uint64 m_self_user_id;
 
+    // Callbacks of everyone waiting for the current authentication to finish.
+    vector<pair<SuccessCb, ErrorCb>> m_auth_waiters;
+    bool m_auth_in_progress;
+
     VkOptions m_options;
 
     set<uint64> m_sent_msg_ids;
+    // Outgoing message from Long Poll, waiting for messages.send to return its mid.
+    struct PendingEcho
+    {
+        uint64 msg_id;
+        steady_time_point deadline;
+        SuccessCb process_cb;
+    };
+    // Ordered by deadline. A single timer is used for all of them, see sweep_pending_echoes.
+    std::deque<PendingEcho> m_pending_echoes;
+    bool m_echo_sweep_scheduled;
     steady_time_point m_last_msg_sent_time;
 
     set<uint64> m_manually_added_buddies;
@@ -377,3 +506,9 @@ string chat_name_from_id(uint64 chat_id);
 // If quiet is false, the function will output an error into log if it returns zero.
 uint64 chat_id_from_name(const char* name, bool quiet = false);
 
+// Appends the raw response to the capture file, set by VKCOM_CAPTURE_FILE environment variable, so that
+// real traffic can be recorded for profiling the receive path offline. source is either "longpoll" or
+// "api:<method name>". Does nothing if the variable is not set. Access token, Long Poll key and upload
+// server addresses are removed from the text.
+void capture_response(PurpleConnection* gc, const string& source, const char* response_text);
+
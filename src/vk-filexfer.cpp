@@ -100,7 +100,7 @@ bool send_doc(PurpleConnection* gc, uint64 user_id, const VkUploadedDocInfo& doc
     send_doc_url(gc, user_id, doc_url, false);
 
     // Store the uploaded document.
-    uint64 doc_id = d.get("id").get<double>();
+    uint64 doc_id = json_int(d.get("id"));
     VkData& gc_data = get_data(gc);
     gc_data.uploaded_docs[doc_id] = doc;
     gc_data.uploaded_docs[doc_id].url = doc_url;
@@ -145,6 +145,9 @@ void start_uploading_doc(PurpleConnection* gc, PurpleXfer* xfer, const VkUploade
     });
 }
 
+// Number of docs.get pages, which are requested simultaneously.
+const size_t MAX_PARALLEL_DOCS_PAGES = 3;
+
 // Calls docs.get for the current user and removes all the docs from uploaded_docs, which do not exist
 // or do not match the stored parameters.
 void clean_nonexisting_docs(PurpleConnection* gc, const SuccessCb& success_cb)
@@ -161,14 +164,14 @@ void clean_nonexisting_docs(PurpleConnection* gc, const SuccessCb& success_cb)
             return;
         }
 
-        uint64 doc_id = v.get("id").get<double>();
+        uint64 doc_id = json_int(v.get("id"));
 
         VkData& gc_data = get_data(gc);
         if (contains(gc_data.uploaded_docs, doc_id)) {
             const VkUploadedDocInfo& doc = gc_data.uploaded_docs[doc_id];
 
             const string& title = v.get("title").get<string>();
-            uint64 size = v.get("size").get<double>();
+            uint64 size = json_int(v.get("size"));
             const string& url = v.get("url").get<string>();
 
             if (doc.filename == title && doc.size == size && doc.url == url)
@@ -197,7 +200,7 @@ void clean_nonexisting_docs(PurpleConnection* gc, const SuccessCb& success_cb)
 
         if (success_cb)
             success_cb();
-    });
+    }, MAX_PARALLEL_DOCS_PAGES);
 }
 
 // Either finds matching doc, checks that it exists and sends it or uploads new doc.
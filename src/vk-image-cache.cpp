@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <iterator>
+#include <list>
+
+#include <glib/gstdio.h>
+#include <imgstore.h>
+#include <util.h>
+
+#include "httputils.h"
+#include "vk-common.h"
+
+#include "vk-image-cache.h"
+
+namespace
+{
+
+// Maximum total size of cached images. Least recently used images are removed once it is exceeded.
+const uint64 MAX_CACHE_SIZE = 64 * 1024 * 1024;
+
+struct CacheEntry
+{
+    string key;
+    uint64 size;
+};
+
+// In-memory index of the cache directory, which is shared by all accounts. Entries are ordered
+// from the most recently used to the least recently used.
+struct ImageCache
+{
+    bool loaded;
+    string dir;
+    std::list<CacheEntry> entries;
+    map<string, std::list<CacheEntry>::iterator> entry_its;
+    uint64 total_size;
+};
+
+ImageCache image_cache;
+
+// Returns cache key for url. Image urls have load-balanced host (the first part of the URL can
+// randomly change from one call to another, see update_blist_buddy), so only the path is used.
+// Unlike buddy icons, only the filename is not enough: stickers of different packs share filenames.
+string get_cache_key(const string& url)
+{
+    size_t path_start = url.find("://");
+    path_start = path_start == string::npos ? 0 : url.find('/', path_start + 3);
+    if (path_start == string::npos)
+        path_start = 0;
+
+    gchar* checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, url.data() + path_start, -1);
+    string key = checksum;
+    g_free(checksum);
+    return key;
+}
+
+string get_cache_path(const string& key)
+{
+    char* path = g_build_filename(image_cache.dir.data(), key.data(), nullptr);
+    string ret = path;
+    g_free(path);
+    return ret;
+}
+
+// Removes the least recently used images until the cache fits into MAX_CACHE_SIZE.
+void evict_cache_entries()
+{
+    while (image_cache.total_size > MAX_CACHE_SIZE && !image_cache.entries.empty()) {
+        const CacheEntry& entry = image_cache.entries.back();
+        g_unlink(get_cache_path(entry.key).data());
+        image_cache.total_size -= entry.size;
+        image_cache.entry_its.erase(entry.key);
+        image_cache.entries.pop_back();
+    }
+}
+
+void remove_cache_entry(const string& key)
+{
+    auto it = image_cache.entry_its.find(key);
+    if (it == image_cache.entry_its.end())
+        return;
+    image_cache.total_size -= it->second->size;
+    image_cache.entries.erase(it->second);
+    image_cache.entry_its.erase(it);
+}
+
+void add_cache_entry(const string& key, uint64 size)
+{
+    remove_cache_entry(key);
+    image_cache.entries.push_front({ key, size });
+    image_cache.entry_its[key] = image_cache.entries.begin();
+    image_cache.total_size += size;
+    evict_cache_entries();
+}
+
+// Marks the entry as the most recently used. Modification time of the file is updated too,
+// so that the order is preserved between sessions.
+void touch_cache_entry(const string& key)
+{
+    auto it = image_cache.entry_its.find(key);
+    image_cache.entries.splice(image_cache.entries.begin(), image_cache.entries, it->second);
+    g_utime(get_cache_path(key).data(), nullptr);
+}
+
+// Reads the list of cached images from the cache directory upon the first call.
+void load_image_cache()
+{
+    if (image_cache.loaded)
+        return;
+    image_cache.loaded = true;
+
+    char* dir = g_build_filename(purple_user_dir(), "vkcom", "image-cache", nullptr);
+    image_cache.dir = dir;
+    g_free(dir);
+    if (g_mkdir_with_parents(image_cache.dir.data(), 0700) != 0) {
+        vkcom_debug_error("Unable to create image cache directory %s\n", image_cache.dir.data());
+        return;
+    }
+
+    GDir* cache_dir = g_dir_open(image_cache.dir.data(), 0, nullptr);
+    if (!cache_dir)
+        return;
+
+    struct CachedFile
+    {
+        string key;
+        uint64 size;
+        time_t mtime;
+    };
+    vector<CachedFile> files;
+    while (const char* name = g_dir_read_name(cache_dir)) {
+        GStatBuf stat_buf;
+        if (g_stat(get_cache_path(name).data(), &stat_buf) == 0)
+            files.push_back({ name, (uint64)stat_buf.st_size, stat_buf.st_mtime });
+    }
+    g_dir_close(cache_dir);
+
+    std::sort(files.begin(), files.end(), [](const CachedFile& a, const CachedFile& b) {
+        return a.mtime > b.mtime;
+    });
+    for (const CachedFile& file: files) {
+        image_cache.entries.push_back({ file.key, file.size });
+        image_cache.entry_its[file.key] = std::prev(image_cache.entries.end());
+        image_cache.total_size += file.size;
+    }
+    vkcom_debug_info("Loaded image cache: %zu images, %llu bytes\n", files.size(),
+                     (unsigned long long)image_cache.total_size);
+    evict_cache_entries();
+}
+
+} // End of anonymous namespace
+
+void fetch_cached_image(PurpleConnection* gc, const string& url, const ImageCb& image_cb)
+{
+    load_image_cache();
+
+    string key = get_cache_key(url);
+    if (contains(image_cache.entry_its, key)) {
+        string path = get_cache_path(key);
+        gchar* contents;
+        gsize size;
+        if (g_file_get_contents(path.data(), &contents, &size, nullptr)) {
+            touch_cache_entry(key);
+            // imgstore takes ownership of contents.
+            image_cb(purple_imgstore_add_with_id(contents, size, nullptr));
+            return;
+        }
+
+        vkcom_debug_error("Unable to read cached image %s\n", path.data());
+        remove_cache_entry(key);
+    }
+
+    http_get(gc, url, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
+        if (!purple_http_response_is_successful(response)) {
+            vkcom_debug_error("Unable to download image: %s\n",
+                              purple_http_response_get_error(response));
+            image_cb(0);
+            return;
+        }
+
+        size_t size;
+        const char* img_data = purple_http_response_get_data(response, &size);
+        string path = get_cache_path(key);
+        if (g_file_set_contents(path.data(), img_data, size, nullptr))
+            add_cache_entry(key, size);
+        else
+            vkcom_debug_error("Unable to write cached image %s\n", path.data());
+
+        image_cb(purple_imgstore_add_with_id(g_memdup(img_data, size), size, nullptr));
+    });
+}
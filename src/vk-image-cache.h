@@ -0,0 +1,15 @@
+// On-disk cache for images, shown in messages and "Get Info" (thumbnails, stickers, user photos).
+
+#pragma once
+
+#include "common.h"
+
+#include <connection.h>
+
+// Receives id of the image in imgstore or 0 if the image could not be fetched.
+typedef function_ptr<void(int img_id)> ImageCb;
+
+// Adds image, located at url, to imgstore and passes its id to image_cb. The image is read from
+// the cache, located in libpurple user dir, if it has been downloaded before, otherwise it is
+// downloaded and saved to the cache. image_cb may be called before the function returns.
+void fetch_cached_image(PurpleConnection* gc, const string& url, const ImageCb& image_cb);
@@ -30,14 +30,65 @@ namespace
 
 // Loads last_msg_id from settings.
 uint64 load_last_msg_id(PurpleConnection* gc);
-// Saves last_msg_id to settings.
+// Saves last_msg_id to settings. Saving is deferred for a few seconds, so that busy chats do not
+// modify account settings upon each message, see flush_long_poll_state.
 void save_last_msg_id(PurpleConnection* gc, uint64 last_msg_id);
 
+// NOTE: Re Long Poll position: ts and pts from the last processed Long Poll response are stored
+// along with last_msg_id. messages.getLongPollHistory returns all the events and messages since
+// this position, so catching up after reconnect usually costs a single call. Zero pts means
+// there is no stored position (e.g. the first login) and messages are received by id range.
+
+// Loads Long Poll position from settings.
+void load_long_poll_position(PurpleConnection* gc, uint64& ts, uint64& pts);
+// Saves Long Poll position to settings. Saving is deferred the same way as for last_msg_id.
+void save_long_poll_position(PurpleConnection* gc, uint64 ts, uint64 pts);
+// Flushes last_msg_id and Long Poll position to settings in a few seconds, unless already scheduled.
+// Must be called before modifying unsaved values in VkData.
+void schedule_long_poll_state_flush(PurpleConnection* gc);
+
 // Helper for start_long_poll.
 void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id);
 
 } // End of anonymous namespace
 
+void resume_long_poll(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.suspended_long_poll) {
+        vkcom_debug_info("Resuming Long Poll\n");
+        SuccessCb suspended_long_poll = gc_data.suspended_long_poll;
+        gc_data.suspended_long_poll = nullptr;
+        suspended_long_poll();
+    } else if (gc_data.long_poll_connection) {
+        // Otherwise the request would hang until the timeout.
+        vkcom_debug_info("Restarting Long Poll request after network change\n");
+        PurpleHttpConnection* http_conn = gc_data.long_poll_connection;
+        SuccessCb restart_long_poll = gc_data.restart_long_poll;
+        gc_data.long_poll_request_id++;
+        gc_data.long_poll_connection = nullptr;
+        gc_data.restart_long_poll = nullptr;
+        purple_http_conn_cancel(http_conn);
+        restart_long_poll();
+    }
+}
+
+void flush_long_poll_state(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    PurpleAccount* account = purple_connection_get_account(gc);
+    if (gc_data.unsaved_last_msg_id != 0)
+        purple_account_set_int(account, "last_msg_id", gc_data.unsaved_last_msg_id);
+    // ts and pts are 64-bit integers, so they are stored in string representation.
+    if (gc_data.unsaved_long_poll_pts != 0) {
+        purple_account_set_string(account, "long_poll_ts", to_string(gc_data.unsaved_long_poll_ts).data());
+        purple_account_set_string(account, "long_poll_pts", to_string(gc_data.unsaved_long_poll_pts).data());
+    }
+    gc_data.unsaved_last_msg_id = 0;
+    gc_data.unsaved_long_poll_ts = 0;
+    gc_data.unsaved_long_poll_pts = 0;
+}
+
 void start_long_poll(PurpleConnection* gc)
 {
     uint64 last_msg_id = load_last_msg_id(gc);
@@ -50,14 +101,57 @@ namespace
 
 uint64 load_last_msg_id(PurpleConnection* gc)
 {
+    uint64 unsaved_last_msg_id = get_data(gc).unsaved_last_msg_id;
+    if (unsaved_last_msg_id != 0)
+        return unsaved_last_msg_id;
+
     PurpleAccount* account = purple_connection_get_account(gc);
     return purple_account_get_int(account, "last_msg_id", 0);
 }
 
 void save_last_msg_id(PurpleConnection* gc, uint64 last_msg_id)
 {
+    schedule_long_poll_state_flush(gc);
+    get_data(gc).unsaved_last_msg_id = last_msg_id;
+}
+
+void load_long_poll_position(PurpleConnection* gc, uint64& ts, uint64& pts)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.unsaved_long_poll_pts != 0) {
+        ts = gc_data.unsaved_long_poll_ts;
+        pts = gc_data.unsaved_long_poll_pts;
+        return;
+    }
+
     PurpleAccount* account = purple_connection_get_account(gc);
-    return purple_account_set_int(account, "last_msg_id", last_msg_id);
+    ts = atoll(purple_account_get_string(account, "long_poll_ts", "0"));
+    pts = atoll(purple_account_get_string(account, "long_poll_pts", "0"));
+}
+
+void save_long_poll_position(PurpleConnection* gc, uint64 ts, uint64 pts)
+{
+    schedule_long_poll_state_flush(gc);
+    VkData& gc_data = get_data(gc);
+    gc_data.unsaved_long_poll_ts = ts;
+    gc_data.unsaved_long_poll_pts = pts;
+}
+
+void schedule_long_poll_state_flush(PurpleConnection* gc)
+{
+    // If we crash before the state gets saved, messages received during the last few seconds will
+    // be received once more on the next login, which is acceptable.
+    const int SAVE_DELAY = 5000;
+
+    // The timer has already been added if there is anything unsaved.
+    VkData& gc_data = get_data(gc);
+    if (gc_data.unsaved_last_msg_id != 0 || gc_data.unsaved_long_poll_pts != 0)
+        return;
+
+    timeout_add(gc, SAVE_DELAY, [=] {
+        flush_long_poll_state(gc);
+        return false;
+    });
 }
 
 // Helper struct for request_long_poll.
@@ -75,21 +169,58 @@ struct LastMsg
 
 // Connects to given Long Poll server and starts reading events from it. last_msg_id is explained
 // earlier, last_msg_id_from_start is a bit more complex. There are cases when request_long_poll
-// will receive messages, which have already been processed:
+// will receive messages, which have already been processed, see LastMsg.
+//
+// failures is the number of consecutive failed requests, see retry_long_poll.
 void request_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
-                       LastMsg last_msg);
+                       LastMsg last_msg, int failures = 0);
+// Repeats the failed Long Poll request with the same server, key and ts after a jittered
+// exponential backoff, so that a short network outage does not cost the full resync.
+void retry_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
+                     LastMsg last_msg, int failures);
+// Calls retry with the number of consecutive failures after a jittered exponential backoff.
+// Gives up and disconnects after too many consecutive failures. If the network is unavailable,
+// retry is called with zero failures once it becomes available again.
+typedef function_ptr<void(int failures)> RetryCb;
+void schedule_long_poll_retry(PurpleConnection* gc, int failures, const RetryCb& retry);
+// Processes "failed" response from Long Poll server, doing as little as possible to continue.
+void process_long_poll_failed(PurpleConnection* gc, const picojson::value& root, const string& server,
+                              const string& key, uint64 ts, LastMsg last_msg);
+// Requests new Long Poll key and server. If keep_ts is true, continues receiving events from ts,
+// otherwise continues from the new ts, catching up on the messages, which may have been lost.
+// failures is the number of consecutive failed requests, see schedule_long_poll_retry.
+void refresh_long_poll_key(PurpleConnection* gc, uint64 ts, LastMsg last_msg, bool keep_ts,
+                           int failures = 0);
+// Receives the messages and events, which have been missed since the stored Long Poll position,
+// and continues receiving events from ts. pts is the position, corresponding to ts, if known,
+// zero otherwise. If process_presence is false, online/offline events are not requested
+// (presence has just been updated by other means).
+void catch_up_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
+                        uint64 pts, LastMsg last_msg, bool process_presence);
+// Same as catch_up_long_poll, but receives only messages by id range. Used when there is no stored
+// position or messages.getLongPollHistory fails. The position is not saved unless the range has
+// been received, failures is the number of consecutive failed attempts, see schedule_long_poll_retry.
+void catch_up_long_poll_by_range(PurpleConnection* gc, const string& server, const string& key,
+                                 uint64 ts, uint64 pts, LastMsg last_msg, int failures = 0);
+// Saves the new position and starts receiving events from it. max_msg_id is the max id of the
+// messages received while catching up, zero if none.
+void finish_catch_up(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
+                     uint64 pts, LastMsg last_msg, uint64 max_msg_id);
 // Disconnects account on Long Poll errors as we do not have anything to do after that really.
 void long_poll_fatal(PurpleConnection* gc);
 
 void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
 {
-    CallParams params = { {"use_ssl", "1"} };
-    vk_call_api(gc, "messages.getLongPollServer", params, [=](const picojson::value& v) {
+    CallParams params = { {"use_ssl", "1"}, {"need_pts", "1"} };
+    vk_call_api_batched(gc, "messages.getLongPollServer", params, [=](const picojson::value& v) {
         // The connection status can be not connected, because we could've skipped the whole authentication part
         // in vk-auth.cpp if the access token is stored. Here is the first place where we can guarantee, that
         // the connection really succeeded.
-        if (purple_connection_get_state(gc) != PURPLE_CONNECTED)
+        if (purple_connection_get_state(gc) != PURPLE_CONNECTED) {
             purple_connection_set_state(gc, PURPLE_CONNECTED);
+            vkcom_debug_info("Connected in %lldms since login\n", (long long)to_milliseconds(
+                                 steady_clock::now() - get_data(gc).login_time));
+        }
 
         if (!v.is<picojson::object>() || !field_is_present<string>(v, "key")
                 || !field_is_present<string>(v, "server") || !field_is_present<double>(v, "ts")) {
@@ -99,101 +230,230 @@ void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
             return;
         }
 
+        // Copy only the fields we need: capturing v itself would deep-copy the whole response
+        // into each of the nested callbacks.
+        string server = v.get("server").get<string>();
+        string key = v.get("key").get<string>();
+        uint64 ts = json_int(v.get("ts"));
+        uint64 pts = 0;
+        if (field_is_present<double>(v, "pts"))
+            pts = json_int(v.get("pts"));
+
         // First, we update buddy presence and receive unread messages and only then start
         // processing events. We won't miss any events because we already got starting timestamp
         // from server.
         update_friends_presence(gc, [=] {
             // Start updaing user and chat infos, buddy list.
             update_user_chat_infos(gc);
-            receive_messages_range(gc, last_msg_id,  [=](uint64 max_msg_id) {
-                // We've received no new messages.
-                if (max_msg_id == 0)
-                    max_msg_id = last_msg_id;
-                else
-                    save_last_msg_id(gc, max_msg_id);
-
-                if (!field_is_present<string>(v, "server") || !field_is_present<string>(v, "key")
-                        || !field_is_present<double>(v, "ts")) {
-                    vkcom_debug_error("Wrong response from messages.getLongPollServer: %s\n",
-                                       v.serialize().data());
-                    long_poll_fatal(gc);
-                    return;
-                }
-
-                const string& server = v.get("server").get<string>();
-                const string& key = v.get("key").get<string>();
-                double ts = v.get("ts").get<double>();
-                request_long_poll(gc, server, key, ts, { max_msg_id, max_msg_id });
-            });
+            catch_up_long_poll(gc, server, key, ts, pts, { last_msg_id, last_msg_id }, false);
         });
     }, [=](const picojson::value&) {
         long_poll_fatal(gc);
     });
 }
 
-// Reads and processes an event from updates array.
-void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg);
+// Presence, typing and chat updates from one Long Poll response. They are collected while reading
+// the updates and applied once after that, so that a burst of events for the same user or chat
+// results in a single buddy list or chat info update.
+struct UpdatesBatch
+{
+    struct Presence
+    {
+        bool online;
+        // Platform is meaningful only if online is true.
+        uint64 platform;
+    };
+
+    // The last online/offline state for each user.
+    map<uint64, Presence> presence;
+    // Users, which are typing and have not sent a message since.
+    set<uint64> typing_user_ids;
+    // Chats, which parameters have been updated.
+    set<uint64> chat_ids;
+};
+
+// Reads and processes an event from updates array. Messages are processed immediately, other events
+// are collected in batch.
+void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg,
+                    UpdatesBatch& batch);
+// Applies all events, collected in batch.
+void apply_updates_batch(PurpleConnection* gc, const UpdatesBatch& batch);
+
+// Long Poll mode flags.
+enum LongPollMode
+{
+    // Return attachments, which contain "from" for chat messages.
+    LONG_POLL_MODE_ATTACHMENTS = 2,
+    // Return pts with each response (see load_long_poll_position).
+    LONG_POLL_MODE_PTS = 32,
+    // Return platform in online events to detect desktop/mobile status.
+    LONG_POLL_MODE_EXTENDED = 64
+};
+
+// Attachments are only needed for chat messages, so we do not request them while the user
+// participates in no chats. There is no account option, which disables chats, so this is a guess:
+// it saves traffic for users without chats at the cost of one messages.getById call for the first
+// message in a new chat. Such message arrives without attachments and is received via
+// receive_messages_batched, the chat gets added to chat_ids and the next request asks for attachments.
+int get_long_poll_mode(PurpleConnection* gc)
+{
+    int mode = LONG_POLL_MODE_PTS | LONG_POLL_MODE_EXTENDED;
+    if (!get_data(gc).chat_ids.empty())
+        mode |= LONG_POLL_MODE_ATTACHMENTS;
+    return mode;
+}
+
+// Vk.com allows waiting for events up to 90 seconds, but some proxies and NATs silently drop idle
+// connections much earlier. We start with 25 seconds, increase the wait every time the server
+// returns after the full wait and go back to the last good value once the idle request times out.
+const int LONG_POLL_MIN_WAIT = 25;
+const int LONG_POLL_MAX_WAIT = 90;
+const int LONG_POLL_WAIT_STEP = 15;
+// Time in seconds after wait has passed, during which we still wait for the response.
+const int LONG_POLL_TIMEOUT_MARGIN = 15;
+
+int get_long_poll_wait(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.long_poll_wait == 0) {
+        gc_data.long_poll_wait = LONG_POLL_MIN_WAIT;
+        gc_data.long_poll_max_wait = LONG_POLL_MAX_WAIT;
+    }
+    return gc_data.long_poll_wait;
+}
+
+// Called when the request with given wait has returned no updates after elapsed time.
+void on_long_poll_idle(PurpleConnection* gc, int wait, steady_duration elapsed)
+{
+    VkData& gc_data = get_data(gc);
+    if (to_milliseconds(elapsed) < wait * 1000 || wait != gc_data.long_poll_wait
+            || wait >= gc_data.long_poll_max_wait)
+        return;
+
+    gc_data.long_poll_wait = std::min(wait + LONG_POLL_WAIT_STEP, gc_data.long_poll_max_wait);
+    vkcom_debug_info("Increasing Long Poll wait to %ds\n", gc_data.long_poll_wait);
+}
+
+// Called when the request with given wait has failed after elapsed time.
+void on_long_poll_failed(PurpleConnection* gc, int wait, steady_duration elapsed)
+{
+    // Errors before wait has passed are ordinary network errors, not dropped idle connections.
+    VkData& gc_data = get_data(gc);
+    if (to_milliseconds(elapsed) < wait * 1000 || wait <= LONG_POLL_MIN_WAIT)
+        return;
+
+    gc_data.long_poll_max_wait = std::max(wait - LONG_POLL_WAIT_STEP, LONG_POLL_MIN_WAIT);
+    gc_data.long_poll_wait = std::min(gc_data.long_poll_wait, gc_data.long_poll_max_wait);
+    vkcom_debug_info("Long Poll request timed out, decreasing wait to %ds\n", gc_data.long_poll_wait);
+}
 
-// We request platform to detect desktop/mobile status and attachments to get "from"
-// in chats.
-const char* long_poll_url = "https://%s?act=a_check&key=%s&ts=%llu&wait=25&mode=66";
+const char* long_poll_url = "%s%s?act=a_check&key=%s&ts=%llu&wait=%d&mode=%d";
 
 void request_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
-                       LastMsg last_msg)
+                       LastMsg last_msg, int failures)
 {
-    string server_url = str_format(long_poll_url, server.data(), key.data(), ts);
+    int wait = get_long_poll_wait(gc);
+    // Vk.com returns the server without the scheme, but a local mock server (see bench/README.txt)
+    // returns it with "http://".
+    const char* scheme = server.find("://") == string::npos ? "https://" : "";
+    string server_url = str_format(long_poll_url, scheme, server.data(), key.data(), ts, wait,
+                                   get_long_poll_mode(gc));
 #if 0
     vkcom_debug_info("Connecting to Long Poll %s\n", server_url.data());
 #endif
 
-    http_get(gc, server_url, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
+    PurpleHttpRequest* req = purple_http_request_new(server_url.data());
+    purple_http_request_set_timeout(req, wait + LONG_POLL_TIMEOUT_MARGIN);
+    steady_time_point sent_time = steady_clock::now();
+    uint64 network_down_count = get_data(gc).network_down_count;
+    uint64 request_id = ++get_data(gc).long_poll_request_id;
+    // Timeouts are expected here and are handled by on_long_poll_failed and retry_long_poll,
+    // retrying them in http_request as well would multiply the backoff.
+    PurpleHttpConnection* http_conn = http_request(gc, req, [=](PurpleHttpConnection*,
+                                                                PurpleHttpResponse* response) {
         // Connection has been cancelled due to account being disconnected.
         if (get_data(gc).is_closing())
             return;
+        // Connection has been cancelled and the request has been sent again by resume_long_poll.
+        VkData& gc_data = get_data(gc);
+        if (gc_data.long_poll_request_id != request_id)
+            return;
+        gc_data.long_poll_request_id++;
+        gc_data.long_poll_connection = nullptr;
+        gc_data.restart_long_poll = nullptr;
 
         if (purple_http_response_get_code(response) != 200) {
             vkcom_debug_error("Error while reading response from Long Poll server: %s\n",
                                purple_http_response_get_error(response));
-            long_poll_fatal(gc);
+            // The request, which has failed because the network has gone down, says nothing
+            // about idle connections being dropped.
+            if (gc_data.network_available && gc_data.network_down_count == network_down_count)
+                on_long_poll_failed(gc, wait, steady_clock::now() - sent_time);
+            retry_long_poll(gc, server, key, ts, last_msg, failures + 1);
             return;
         }
 
         const char* response_text = purple_http_response_get_data(response, nullptr);
+        capture_response(gc, "longpoll", response_text);
         const char* response_text_copy = response_text; // Picojson updates iterators it received.
         picojson::value root;
+        steady_time_point parse_start = steady_clock::now();
         string error = picojson::parse(root, response_text, response_text + strlen(response_text));
+        VkProcessingStats& processing_stats = get_data(gc).processing_stats;
+        processing_stats.parsed_responses++;
+        processing_stats.parse_time += steady_clock::now() - parse_start;
         if (!error.empty()) {
             vkcom_debug_error("Error parsing %s: %s\n", response_text_copy, error.data());
-            long_poll_fatal(gc);
+            retry_long_poll(gc, server, key, ts, last_msg, failures + 1);
             return;
         }
         if (!root.is<picojson::object>()) {
             vkcom_debug_error("Strange response from Long Poll: %s\n", response_text_copy);
-            long_poll_fatal(gc);
+            retry_long_poll(gc, server, key, ts, last_msg, failures + 1);
             return;
         }
 
         if (root.contains("failed")) {
-            vkcom_debug_info("Long Poll got tired, re-requesting Long Poll server address\n");
-            start_long_poll_impl(gc, last_msg.id);
+            process_long_poll_failed(gc, root, server, key, ts, last_msg);
             return;
         }
 
+        // Updates are processed only after the whole response has been checked, so that a retried
+        // request does not process them twice.
         if (!field_is_present<double>(root, "ts") || !field_is_present<picojson::array>(root, "updates")) {
             vkcom_debug_error("Strange response from Long Poll: %s\n", response_text_copy);
-            long_poll_fatal(gc);
+            retry_long_poll(gc, server, key, ts, last_msg, failures + 1);
             return;
         }
 
-        LastMsg next_last_msg = last_msg;
-
         const picojson::array& updates = root.get("updates").get<picojson::array>();
-        for (const picojson::value& v: updates)
-            process_update(gc, v, next_last_msg);
+        if (updates.empty())
+            on_long_poll_idle(gc, wait, steady_clock::now() - sent_time);
 
-        uint64 next_ts = root.get("ts").get<double>();
+        LastMsg next_last_msg = last_msg;
+        UpdatesBatch batch;
+        steady_time_point process_start = steady_clock::now();
+        for (const picojson::value& v: updates)
+            process_update(gc, v, next_last_msg, batch);
+        apply_updates_batch(gc, batch);
+        processing_stats.long_poll_updates += updates.size();
+        processing_stats.long_poll_time += steady_clock::now() - process_start;
+
+        uint64 next_ts = json_int(root.get("ts"));
+        if (field_is_present<double>(root, "pts"))
+            save_long_poll_position(gc, next_ts, json_int(root.get("pts")));
         request_long_poll(gc, server, key, next_ts, next_last_msg);
-    });
+    }, false);
+    purple_http_request_unref(req);
+
+    // The callback has already been called if the connection has failed right away.
+    VkData& gc_data = get_data(gc);
+    if (http_conn && gc_data.long_poll_request_id == request_id) {
+        gc_data.long_poll_connection = http_conn;
+        gc_data.restart_long_poll = [=] {
+            request_long_poll(gc, server, key, ts, last_msg);
+        };
+    }
 }
 
 // Update codes coming from Long Poll
@@ -212,6 +472,206 @@ enum LongPollCodes
     LONG_POLL_USER_CALLED = 70
 };
 
+// Values of "failed" in Long Poll response.
+enum LongPollFailed
+{
+    // Events history is outdated or partially lost, continue with the new ts from response.
+    LONG_POLL_HISTORY_LOST = 1,
+    // Key has expired, get the new key via messages.getLongPollServer.
+    LONG_POLL_KEY_EXPIRED = 2,
+    // User information has been lost, get the new key and ts via messages.getLongPollServer.
+    LONG_POLL_INFO_LOST = 3
+};
+
+void process_long_poll_failed(PurpleConnection* gc, const picojson::value& root, const string& server,
+                              const string& key, uint64 ts, LastMsg last_msg)
+{
+    int failed = 0;
+    if (field_is_present<double>(root, "failed"))
+        failed = json_int(root.get("failed"));
+
+    if (failed == LONG_POLL_HISTORY_LOST && field_is_present<double>(root, "ts")) {
+        vkcom_debug_info("Long Poll history lost, receiving missed messages\n");
+        uint64 next_ts = json_int(root.get("ts"));
+        catch_up_long_poll(gc, server, key, next_ts, 0, last_msg, true);
+    } else if (failed == LONG_POLL_KEY_EXPIRED) {
+        vkcom_debug_info("Long Poll key expired, requesting new key\n");
+        refresh_long_poll_key(gc, ts, last_msg, true);
+    } else if (failed == LONG_POLL_INFO_LOST) {
+        vkcom_debug_info("Long Poll information lost, requesting new key and ts\n");
+        refresh_long_poll_key(gc, ts, last_msg, false);
+    } else {
+        vkcom_debug_info("Long Poll got tired, re-requesting Long Poll server address\n");
+        start_long_poll_impl(gc, last_msg.id);
+    }
+}
+
+void refresh_long_poll_key(PurpleConnection* gc, uint64 ts, LastMsg last_msg, bool keep_ts,
+                           int failures)
+{
+    RetryCb retry = [=](int next_failures) {
+        refresh_long_poll_key(gc, ts, last_msg, keep_ts, next_failures);
+    };
+
+    CallParams params = { {"use_ssl", "1"}, {"need_pts", "1"} };
+    vk_call_api(gc, "messages.getLongPollServer", params, [=](const picojson::value& v) {
+        if (!field_is_present<string>(v, "key") || !field_is_present<string>(v, "server")
+                || !field_is_present<double>(v, "ts")) {
+            vkcom_debug_error("Strange response from messages.getLongPollServer: %s\n",
+                               v.serialize().data());
+            schedule_long_poll_retry(gc, failures + 1, retry);
+            return;
+        }
+
+        const string& server = v.get("server").get<string>();
+        const string& key = v.get("key").get<string>();
+        uint64 pts = 0;
+        if (field_is_present<double>(v, "pts"))
+            pts = json_int(v.get("pts"));
+        if (keep_ts)
+            request_long_poll(gc, server, key, ts, last_msg);
+        else
+            catch_up_long_poll(gc, server, key, json_int(v.get("ts")), pts, last_msg, true);
+    }, [=](const picojson::value&) {
+        schedule_long_poll_retry(gc, failures + 1, retry);
+    });
+}
+
+void catch_up_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
+                        uint64 pts, LastMsg last_msg, bool process_presence)
+{
+    uint64 stored_ts;
+    uint64 stored_pts;
+    load_long_poll_position(gc, stored_ts, stored_pts);
+    if (stored_pts == 0 || last_msg.id == 0) {
+        catch_up_long_poll_by_range(gc, server, key, ts, pts, last_msg);
+        return;
+    }
+
+    vkcom_debug_info("Receiving Long Poll history since pts %llu\n", (unsigned long long)stored_pts);
+    CallParams params = { {"ts", to_string(stored_ts)}, {"pts", to_string(stored_pts)},
+                          {"onlines", process_presence ? "1" : "0"}, {"msgs_limit", "200"},
+                          {"events_limit", "1000"} };
+    vk_call_api(gc, "messages.getLongPollHistory", params, [=](const picojson::value& v) {
+        if (!field_is_present<picojson::array>(v, "history")
+                || !field_is_present<picojson::object>(v, "messages")
+                || !field_is_present<picojson::array>(v.get("messages"), "items")) {
+            vkcom_debug_error("Strange response from messages.getLongPollHistory: %s\n",
+                              v.serialize().data());
+            catch_up_long_poll_by_range(gc, server, key, ts, pts, last_msg);
+            return;
+        }
+        // Too much has happened since the stored position.
+        if (field_is_present<double>(v, "more") && json_int(v.get("more")) != 0) {
+            vkcom_debug_info("Long Poll history is too long, receiving messages by range\n");
+            catch_up_long_poll_by_range(gc, server, key, ts, pts, last_msg);
+            return;
+        }
+
+        // Messages in history events are incomplete, full messages are returned separately.
+        LastMsg history_last_msg = last_msg;
+        UpdatesBatch batch;
+        VkProcessingStats& processing_stats = get_data(gc).processing_stats;
+        steady_time_point process_start = steady_clock::now();
+        for (const picojson::value& update: v.get("history").get<picojson::array>()) {
+            if (update.is<picojson::array>() && update.contains(0) && update.get(0).is<double>()
+                    && json_int(update.get(0)) == LONG_POLL_MESSAGE)
+                continue;
+            process_update(gc, update, history_last_msg, batch);
+            processing_stats.long_poll_updates++;
+        }
+        apply_updates_batch(gc, batch);
+        processing_stats.long_poll_time += steady_clock::now() - process_start;
+
+        // The position, corresponding to ts, is unknown after "failed" response, but new_pts
+        // is the position right after the returned history.
+        uint64 next_pts = pts;
+        if (next_pts == 0 && field_is_present<double>(v, "new_pts"))
+            next_pts = json_int(v.get("new_pts"));
+
+        // The history is returned since the stored position, which can be older than the messages
+        // we have already processed (e.g. if the position has not been saved before exiting).
+        const picojson::array& items = v.get("messages").get("items").get<picojson::array>();
+        receive_messages_from_items(gc, items, last_msg.id, [=](uint64 max_msg_id) {
+            finish_catch_up(gc, server, key, ts, next_pts, last_msg, max_msg_id);
+        });
+    }, [=](const picojson::value&) {
+        catch_up_long_poll_by_range(gc, server, key, ts, pts, last_msg);
+    });
+}
+
+void catch_up_long_poll_by_range(PurpleConnection* gc, const string& server, const string& key,
+                                 uint64 ts, uint64 pts, LastMsg last_msg, int failures)
+{
+    receive_messages_range(gc, last_msg.id, [=](uint64 max_msg_id) {
+        finish_catch_up(gc, server, key, ts, pts, last_msg, max_msg_id);
+    }, [=] {
+        schedule_long_poll_retry(gc, failures + 1, [=](int next_failures) {
+            catch_up_long_poll_by_range(gc, server, key, ts, pts, last_msg, next_failures);
+        });
+    });
+}
+
+void finish_catch_up(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
+                     uint64 pts, LastMsg last_msg, uint64 max_msg_id)
+{
+    if (pts != 0)
+        save_long_poll_position(gc, ts, pts);
+    if (max_msg_id != 0)
+        save_last_msg_id(gc, max_msg_id);
+    // Catching up is the end of the largest batch of messages, so there is no point in waiting.
+    flush_long_poll_state(gc);
+
+    // We've received no new messages.
+    if (max_msg_id == 0)
+        request_long_poll(gc, server, key, ts, last_msg);
+    else
+        request_long_poll(gc, server, key, ts, { max_msg_id, max_msg_id });
+}
+
+void retry_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
+                     LastMsg last_msg, int failures)
+{
+    schedule_long_poll_retry(gc, failures, [=](int next_failures) {
+        request_long_poll(gc, server, key, ts, last_msg, next_failures);
+    });
+}
+
+void schedule_long_poll_retry(PurpleConnection* gc, int failures, const RetryCb& retry)
+{
+    // About 10 minutes of retries in total.
+    const int MAX_LONG_POLL_FAILURES = 12;
+    const unsigned INITIAL_RETRY_DELAY = 1000;
+    const unsigned MAX_RETRY_DELAY = 2 * 60 * 1000;
+
+    // There is no point in retrying without network, the request is repeated once the network
+    // becomes available. Failures, which have happened while going offline, are not counted.
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.network_available) {
+        vkcom_debug_info("Network is unavailable, suspending Long Poll\n");
+        gc_data.suspended_long_poll = [=] {
+            retry(0);
+        };
+        return;
+    }
+
+    if (failures > MAX_LONG_POLL_FAILURES) {
+        long_poll_fatal(gc);
+        return;
+    }
+
+    // Random delay in [delay / 2, delay) prevents all clients from reconnecting at once after
+    // the server outage.
+    unsigned delay = std::min(INITIAL_RETRY_DELAY << std::min(failures - 1, 16), MAX_RETRY_DELAY);
+    delay = delay / 2 + g_random_int_range(0, delay / 2);
+    vkcom_debug_info("Repeating Long Poll request in %ums, attempt %d\n", delay, failures);
+
+    timeout_add(gc, delay, [=] {
+        retry(failures);
+        return false;
+    });
+}
+
 // Flags, which can be present for message.
 enum MessageFlags
 {
@@ -230,13 +690,16 @@ enum MessageFlags
 // Processes message event.
 void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg);
 // Processes user online/offline event.
-void process_online(PurpleConnection* gc, const picojson::value& v, bool online);
+void process_online(const picojson::value& v, bool online, UpdatesBatch& batch);
 // Processes update of chat parameters.
-void process_chat_update(PurpleConnection* gc, const picojson::value& v);
+void process_chat_update(const picojson::value& v, UpdatesBatch& batch);
 // Processes user typing event.
-void process_typing(PurpleConnection* gc, const picojson::value& v);
+void process_typing(const picojson::value& v, UpdatesBatch& batch);
+// Updates user presence in buddy list.
+void apply_presence(PurpleConnection* gc, uint64 user_id, const UpdatesBatch::Presence& presence);
 
-void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg)
+void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg,
+                    UpdatesBatch& batch)
 {
     if (!v.is<picojson::array>() || !v.contains(0)) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
@@ -244,28 +707,53 @@ void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& las
         return;
     }
 
-    int code = v.get(0).get<double>();
+    int code = json_int(v.get(0));
     switch (code) {
     case LONG_POLL_MESSAGE:
         process_message(gc, v, last_msg);
+        // The user has stopped typing, once the message has been sent. Our own outgoing messages
+        // have the same user id, so they must not cancel the typing of the other side.
+        if (v.contains(3) && v.get(3).is<double>() && v.get(2).is<double>()
+                && !(json_int(v.get(2)) & MESSAGE_FLAGS_OUTBOX))
+            batch.typing_user_ids.erase(json_int(v.get(3)));
         break;
     case LONG_POLL_ONLINE:
-        process_online(gc, v, true);
+        process_online(v, true, batch);
         break;
     case LONG_POLL_OFFLINE:
-        process_online(gc, v, false);
+        process_online(v, false, batch);
         break;
     case LONG_POLL_CHAT_PARAMS_UPDATED:
-        process_chat_update(gc, v);
+        process_chat_update(v, batch);
         break;
     case LONG_POLL_USER_STARTED_TYPING:
-        process_typing(gc, v);
+        process_typing(v, batch);
         break;
     default:
         break;
     }
 }
 
+void apply_updates_batch(PurpleConnection* gc, const UpdatesBatch& batch)
+{
+    for (const pair<uint64, UpdatesBatch::Presence>& p: batch.presence)
+        apply_presence(gc, p.first, p.second);
+
+    if (!batch.chat_ids.empty()) {
+        vkcom_debug_info("Updating parameters for chats %s\n",
+                         str_concat_int(',', batch.chat_ids).data());
+        update_chat_infos(gc, batch.chat_ids, nullptr, true);
+    }
+
+    for (uint64 user_id: batch.typing_user_ids) {
+        add_buddy_if_needed(gc, user_id, [=] {
+            // Vk.com documentation states, that "user is typing" messages are sent with ~10 second
+            // interval between them. Let's make it 11, just to be sure.
+            serv_got_typing(gc, user_name_from_id(user_id).data(), 11, PURPLE_TYPING);
+        });
+    }
+}
+
 // Process incoming and outgoing messages respectively. In general, there is duplication between these functions
 // and vk-message-recv code, they should somehow be refactored.
 void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int flags, uint64 user_id, string text,
@@ -282,22 +770,20 @@ void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& la
                                        i18n("Unable to receive message"));
         return;
     }
-    uint64 msg_id = v.get(1).get<double>();
+    uint64 msg_id = json_int(v.get(1));
     // Check if we already processed this message in receive_messages_range.
     if (msg_id <= last_msg.ignored)
         return;
 
     if (msg_id > last_msg.id) {
         last_msg.id = msg_id;
-        // Pidgin defaults saving to once per 5 seconds, so there is no problem with resetting this
-        // value frequently.
         save_last_msg_id(gc, msg_id);
     }
 
-    int flags = v.get(2).get<double>();
+    int flags = json_int(v.get(2));
 
-    uint64 user_id = v.get(3).get<double>();
-    uint64 timestamp = v.get(4).get<double>();
+    uint64 user_id = json_int(v.get(3));
+    uint64 timestamp = json_int(v.get(4));
     // NOTE:
     // * The text is simple UTF-8 text with some HTML leftovers:
     //   * The only tag which it may contain is <br> (API v5.0 stopped using <br>, but Long Poll
@@ -338,19 +824,14 @@ void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& la
         }
 
         // The last message, which has been sent by us, has been sent not long ago (i.e. less
-        // than 1 second).
+        // than 30 seconds).
         vkcom_debug_info("We sent message not long ago, let's have a check after timeout\n");
-        timeout_add(gc, 30000, [=] {
-            // Check again after 30 seconds, whether we sent the message or not.
-            if (get_data(gc).remove_sent_msg_id(msg_id))
-                return false;
-
+        gc_data.add_pending_echo(msg_id, std::chrono::seconds(30), [=] {
             vkcom_debug_error("We have sent a message not long ago, but not all"
                               " msg id are belong to us (msg id %llu)\n",
                               (unsigned long long)msg_id);
             process_outgoing_message_internal(gc, msg_id, flags, user_id, std::move(text),
                                               timestamp);
-            return false;
         });
     }
 }
@@ -369,15 +850,15 @@ void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int
     //  There are two ways of processing messages with attachments:
     //   a) either we can get attachement ids (photo ids, audio ids etc.) from Long Poll event and
     //      get information via photo.getById et al, or
-    //   b) we can get all the messages with attachments via receive_messages.
+    //   b) we can get all the messages with attachments via receive_messages_batched.
     //  While the first way seems preferable at first, it has quite a number of problems:
     //   * access to information on private images/documents/etc. (e.g. ones uploaded from Vk.com
     //     chat UI) is prohibited and we can only show links to the corresponding page;
     //   * there is no video.getById so we can show no information on video;
-    //   * it takes at least one additional call per message (receive_messages takes exactly one
-    //     call).
+    //   * it takes at least one additional call per message (receive_messages_batched takes one
+    //     call for all the messages, received during a short time window).
     if (flags & MESSAGE_FLAG_MEDIA) {
-        receive_messages(gc, { msg_id });
+        receive_messages_batched(gc, { msg_id });
     } else {
         convert_incoming_smileys(text);
 
@@ -390,22 +871,32 @@ void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int
         } else {
             uint64 chat_id = user_id - CHAT_ID_OFFSET;
 
-            if (!attachments || !attachments->contains("from")
+            // Attachments are not requested until the user participates in some chat, see
+            // get_long_poll_mode, so the first message in a new chat arrives without them.
+            if (!attachments || (attachments->is<picojson::object>()
+                                 && attachments->get<picojson::object>().empty())) {
+                vkcom_debug_info("Chat message %llu without attachments, receiving it separately\n",
+                                 (unsigned long long)msg_id);
+                receive_messages_batched(gc, { msg_id });
+                return;
+            }
+
+            if (!attachments->contains("from")
                     || !attachments->get("from").is<string>()) {
-                vkcom_debug_error("Chat message has wrong attachments: %s\n", attachments
-                                  ? attachments->serialize().data() : "null");
+                vkcom_debug_error("Chat message has wrong attachments: %s\n",
+                                  attachments->serialize().data());
                 // Let's try to receive the message the other way.
-                receive_messages(gc, { msg_id });
+                receive_messages_batched(gc, { msg_id });
                 return;
             }
 
             const string& from_user_id_str = attachments->get("from").get<string>();
             uint64 from_user_id = atoll(from_user_id_str.data());
             if (from_user_id == 0) {
-                vkcom_debug_error("Chat message has wrong attachments: %s\n", attachments
-                                  ? attachments->serialize().data() : "null");
+                vkcom_debug_error("Chat message has wrong attachments: %s\n",
+                                  attachments->serialize().data());
                 // Let's try to receive the message the other way.
-                receive_messages(gc, { msg_id });
+                receive_messages_batched(gc, { msg_id });
                 return;
             }
 
@@ -427,7 +918,7 @@ void process_outgoing_message_internal(PurpleConnection* gc, uint64 msg_id, int
     // See NOTE in process_incoming_message_internal. Unlik incoming messages, we know perfectly
     // well who is the message author for outgoing messages.
     if (flags & MESSAGE_FLAG_MEDIA) {
-        receive_messages(gc, { msg_id });
+        receive_messages_batched(gc, { msg_id });
     } else {
         convert_incoming_smileys(text);
 
@@ -460,22 +951,38 @@ void process_outgoing_message_internal(PurpleConnection* gc, uint64 msg_id, int
     }
 }
 
-void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
+void process_online(const picojson::value& v, bool online, UpdatesBatch& batch)
 {
     if (!v.contains(1) || !v.get(1).is<double>()) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
                            v.serialize().data());
         return;
     }
-    if (v.get(1).get<double>() > 0) {
+    if (json_int(v.get(1)) > 0) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
                            v.serialize().data());
         return;
     }
-    uint64 user_id = -v.get(1).get<double>();
+    uint64 user_id = -json_int(v.get(1));
+
+    UpdatesBatch::Presence presence = { online, 0 };
+    if (online) {
+        if (!v.contains(2) || !v.get(2).is<double>()) {
+            vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
+                               v.serialize().data());
+            return;
+        }
+        presence.platform = uint64(json_int(v.get(2))) % 0x100;
+    }
+    // Only the last state matters.
+    batch.presence[user_id] = presence;
+}
+
+void apply_presence(PurpleConnection* gc, uint64 user_id, const UpdatesBatch::Presence& presence)
+{
     string name = user_name_from_id(user_id);
 
-    vkcom_debug_info("User %s changed online to %d\n", name.data(), online);
+    vkcom_debug_info("User %s changed online to %d\n", name.data(), presence.online);
 
     if (!user_in_buddy_list(gc, user_id)) {
         vkcom_debug_info("User %s has come online, but is not present in buddy list."
@@ -489,15 +996,8 @@ void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
             return;
         }
 
-        if (online) {
-            if (!v.contains(2) || !v.get(2).is<double>()) {
-                vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
-                                   v.serialize().data());
-                return;
-            }
-            uint64 platform = uint64(v.get(2).get<double>()) % 0x100;
-
-            if (platform == PLATFORM_WEB) {
+        if (presence.online) {
+            if (presence.platform == PLATFORM_WEB) {
                 info->online = true;
                 info->online_mobile = false;
             } else {
@@ -515,34 +1015,26 @@ void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
     }
 }
 
-void process_chat_update(PurpleConnection* gc, const picojson::value& v)
+void process_chat_update(const picojson::value& v, UpdatesBatch& batch)
 {
     if (!v.contains(1) || !v.get(1).is<double>()) {
         vkcom_debug_error("Strange respone form Long Poll in updates: %s\n",
                           v.serialize().data());
         return;
     }
-    uint64 chat_id = v.get(1).get<double>();
-
-    vkcom_debug_info("Updating parameters for chat %llu\n", (unsigned long long)chat_id);
-
-    update_chat_infos(gc, { chat_id }, nullptr, true);
+    uint64 chat_id = json_int(v.get(1));
+    batch.chat_ids.insert(chat_id);
 }
 
-void process_typing(PurpleConnection* gc, const picojson::value& v)
+void process_typing(const picojson::value& v, UpdatesBatch& batch)
 {
     if (!v.contains(1) || !v.get(1).is<double>()) {
         vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
                            v.serialize().data());
         return;
     }
-    uint64 user_id = v.get(1).get<double>();
-
-    add_buddy_if_needed(gc, user_id, [=] {
-        // Vk.com documentation states, that "user is typing" messages are sent with ~10 second
-        // interval between them. Let's make it 11, just to be sure.
-        serv_got_typing(gc, user_name_from_id(user_id).data(), 11, PURPLE_TYPING);
-    });
+    uint64 user_id = json_int(v.get(1));
+    batch.typing_user_ids.insert(user_id);
 }
 
 void long_poll_fatal(PurpleConnection* gc)
@@ -11,3 +11,13 @@
 // Initiates connection to Long Poll server and processes retrieved events. Long Poll update
 // loop terminates with termination of all HTTP connections, associated with gc.
 void start_long_poll(PurpleConnection* gc);
+
+// Continues Long Poll after the network has become available again, if it has been suspended.
+// If a request is in progress, it is cancelled and sent again right away, because its connection
+// has most probably died with the previous network. Long Poll resumes from the last ts, so no
+// events are lost.
+void resume_long_poll(PurpleConnection* gc);
+
+// Saves the id of the last processed message and Long Poll position to account settings right away.
+// Saving is otherwise deferred for a few seconds. Must be called before the connection is closed.
+void flush_long_poll_state(PurpleConnection* gc);
@@ -1,16 +1,17 @@
 #include <algorithm>
+#include <iterator>
 #include <time.h>
 
-#include <imgstore.h>
 #include <server.h>
 #include <util.h>
 
-#include "httputils.h"
+#include "json-schema.h"
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-buddy.h"
 #include "vk-chat.h"
 #include "vk-common.h"
+#include "vk-image-cache.h"
 #include "vk-utils.h"
 #include "vk-smileys.h"
 
@@ -23,10 +24,15 @@ namespace
 // The amount of messages to synchronize when logging in for the first time.
 const uint64 MAX_MESSAGES_ON_FIRST_TIME = 5000;
 
-// Function, which returns the last message id, which the user received. It is used to calculate
-// message id, which we start receiving messages from.
+// The number of message ids, requested by one messages.getById call (it accepts no more than 100 ids).
+const uint64 MESSAGES_WINDOW_SIZE = 100;
+
+// Function, which returns the id of the newest message, either received or sent by the user. It is
+// used to calculate message id, which we start receiving messages from, and the end of the range.
+// error_cb is called if the id cannot be received: zero would mean there are no messages at all.
 typedef function_ptr<void(uint64 msg_id)> LastMessageIdCb;
-void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_cb);
+void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_cb,
+                         const ErrorCb& error_cb);
 
 enum MessageStatus {
     MESSAGE_INCOMING_READ,
@@ -48,7 +54,7 @@ struct Message
     // replaced in download_thumbnails.
     vector<string> thumbnail_urls;
     // A list of user and group ids, used in the message. Set in process_attachments
-    // and process_fwd_message, replaced in replace_user_ids and replace_group_ids.
+    // and process_fwd_message, replaced in replace_placeholders.
     vector<uint64> unknown_user_ids;
     vector<uint64> unknown_group_ids;
 };
@@ -60,11 +66,54 @@ struct MessagesData
     ReceivedCb received_cb;
 
     vector<Message> messages;
+    // Logs for the messages, which are not written to open conversations. Shared by all chunks
+    // of receive_messages_range, so that each log file is created once per range. If empty,
+    // finish_receiving opens logs for these messages only.
+    shared_ptr<PurpleLogCache> logs;
 };
 typedef shared_ptr<MessagesData> MessagesData_ptr;
 
-// Receives all messages starting after last_msg_id.
-void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_msg_id, bool outgoing);
+// The state of receive_messages_range. Message ids are increasing by one for each message of
+// the account, both incoming and outgoing, so the range is split into windows of consecutive ids,
+// which are received via messages.getById. Unlike offsets in messages.get, ids do not shift when
+// new messages arrive, so no message can be skipped. A few windows are requested concurrently
+// and are delivered as chunks from the oldest one to the newest one, once all preceding windows
+// have been delivered. Only a few windows are kept in memory regardless of the size of the range.
+struct MessagesRangeData
+{
+    PurpleConnection* gc;
+    ReceivedCb received_cb;
+    // Messages with ids in (last_msg_id, max_msg_id] are received.
+    uint64 last_msg_id;
+    uint64 max_msg_id;
+
+    // The first id of the next window to request and to deliver.
+    uint64 next_request_msg_id;
+    uint64 next_deliver_msg_id;
+    // The number of windows, which are being requested.
+    size_t requesting;
+    // Received windows, which have not been delivered yet, by the first id of window. Messages
+    // in each window are sorted by mid.
+    map<uint64, vector<Message>> windows;
+
+    // True while the chunk is being delivered. Chunks are delivered one at a time to keep the order.
+    bool delivering;
+    // The maximum id of delivered messages.
+    uint64 max_delivered_msg_id;
+    // Logs, shared by all the delivered chunks, see MessagesData.
+    shared_ptr<PurpleLogCache> logs;
+};
+typedef shared_ptr<MessagesRangeData> MessagesRangeData_ptr;
+
+// Receives all messages with ids in (last_msg_id, max_msg_id].
+void receive_messages_range_internal(PurpleConnection* gc, uint64 last_msg_id, uint64 max_msg_id,
+                                     const ReceivedCb& received_cb);
+// Requests next windows unless too many windows are being requested or waiting for delivery.
+void request_messages_windows(const MessagesRangeData_ptr& range);
+void request_messages_window(const MessagesRangeData_ptr& range, uint64 start_msg_id);
+// Delivers all the received windows, which follow the delivered ones, as one chunk unless another
+// chunk is being delivered. Calls received_cb once all the messages have been delivered.
+void deliver_messages_chunk(const MessagesRangeData_ptr& range);
 
 // Processes one item from the result of messages.get and messages.getById.
 void process_message(const MessagesData_ptr& data, const picojson::value& fields);
@@ -96,51 +145,62 @@ void process_gift_attachment(const picojson::value& fields, Message& message, co
 void process_geo(const picojson::value& fields, Message& message);
 
 // Appends specific thumbnail placeholder to the end of message text. Placeholder will be replaced
-// by actual image later in download_thumbnail(). If prepend_br is false, <br> is prepended only
+// by actual image later in download_thumbnails(). If prepend_br is false, <br> is prepended only
 // when message text is not empty.
 void append_thumbnail_placeholder(const string& thumbnail_url, Message& message,
                                   const VkOptions& options, bool prepend_br = true);
 // Returns user/group placeholder, which should be appended to the message text. It will
-// be replaced with actual user/group name and link to the page later in replace_user/group_ids().
+// be replaced with actual user/group name and link to the page later in replace_placeholders().
 string get_user_placeholder(PurpleConnection* gc, uint64 user_id, Message& message);
 string get_group_placeholder(PurpleConnection* gc, uint64 group_id, Message& message);
 
-// Downloads the given thumbnail for given message, modifies corresponding message text
-// and calls either next download_thumbnail() or finish(). message is index into m_messages,
-// thumbnail is index into thumbnail_urls.
-void download_thumbnail(const MessagesData_ptr& data, size_t msg_num, size_t thumb_num);
-// Replaces all placeholder texts for user/group ids in messages with user/group names
-// and hrefs. Gets information on users, which are not present in user_infos, and groups
-// from vk.com
-void replace_user_ids(const MessagesData_ptr& data);
-void replace_group_ids(const MessagesData_ptr& data);
-// Adds all users and groups which are senders/receiveirs of message (needed to get their names/open
-// conversation with them).
-void add_unknown_users_chats(const MessagesData_ptr& data);
+// Thumbnails of all messages, which are being downloaded. Each element of thumbnails is a pair
+// of index into messages and index into thumbnail_urls.
+struct ThumbnailDownloads
+{
+    MessagesData_ptr data;
+    vector<pair<size_t, size_t>> thumbnails;
+    // Index of the next thumbnail to download.
+    size_t next;
+    // Number of thumbnails, which have not been downloaded yet (or failed).
+    size_t remaining;
+};
+typedef shared_ptr<ThumbnailDownloads> ThumbnailDownloads_ptr;
+
+// Downloads thumbnails of all messages, several at a time, replaces placeholders in the message
+// texts as soon as each thumbnail arrives and calls resolve_ids() after all of them.
+// Thumbnails, which failed to download, are left as placeholders.
+void download_thumbnails(const MessagesData_ptr& data);
+// Downloads the next thumbnail from downloads, if there is any left, and calls itself upon
+// completion. Several such chains run in parallel.
+void download_next_thumbnail(const ThumbnailDownloads_ptr& downloads);
+// Gets information on all unknown users, groups and chats, which are either mentioned in messages
+// or are senders/receivers of messages (needed to get their names/open conversation with them).
+// All the calls are made at once, so they are sent in one batch. Then replaces placeholders,
+// adds chats and buddies to buddy list and calls finish_receiving().
+void resolve_ids(const MessagesData_ptr& data);
+// Replaces all placeholder texts for user/group ids in message with user/group names and hrefs.
+void replace_placeholders(PurpleConnection* gc, Message& message);
 // Sorts received messages, sends them to libpurple client and destroys this.
 void finish_receiving(const MessagesData_ptr& data);
 
 } // End of anonymous namespace
 
-void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb)
+void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb,
+                            const ErrorCb& error_cb)
 {
-    MessagesData_ptr data{ new MessagesData };
-    data->gc = gc;
-    data->received_cb = received_cb;
-
-    if (last_msg_id == 0) {
-        // The user has logged in from this computer for the first time. Do not download the
-        // whole history, but get the last message id and download no more than MAX_MESSAGES_ON_FIRST_TIME
-        // before it.
-        get_last_message_id(gc, [=](uint64 real_last_msg_id) {
+    get_last_message_id(gc, [=](uint64 real_last_msg_id) {
+        if (last_msg_id == 0) {
+            // The user has logged in from this computer for the first time. Do not download the
+            // whole history, but download no more than MAX_MESSAGES_ON_FIRST_TIME before the last message.
             uint64 start_msg_id = 0;
             if (real_last_msg_id > MAX_MESSAGES_ON_FIRST_TIME)
                 start_msg_id = real_last_msg_id - MAX_MESSAGES_ON_FIRST_TIME;
-            receive_messages_range_internal(data, start_msg_id, false);
-        });
-    } else {
-        receive_messages_range_internal(data, last_msg_id, false);
-    }
+            receive_messages_range_internal(gc, start_msg_id, real_last_msg_id, received_cb);
+        } else {
+            receive_messages_range_internal(gc, last_msg_id, real_last_msg_id, received_cb);
+        }
+    }, error_cb);
 }
 
 void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids)
@@ -156,53 +216,191 @@ void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids)
     vk_call_api_items(data->gc, "messages.getById", params, false, [=](const picojson::value& message) {
         process_message(data, message);
     }, [=] {
-        download_thumbnail(data, 0, 0);
+        download_thumbnails(data);
     }, [=](const picojson::value&) {
         finish_receiving(data);
     });
 }
 
+void receive_messages_batched(PurpleConnection* gc, const vector<uint64>& message_ids)
+{
+    // Message ids are collected during this time window and then received all at once.
+    const int BATCH_WINDOW = 100;
+    // messages.getById accepts no more than 100 ids.
+    const size_t MAX_BATCH_SIZE = 100;
+
+    if (message_ids.empty())
+        return;
+
+    VkData& gc_data = get_data(gc);
+    bool add_timer = gc_data.batched_message_ids.empty();
+    append(gc_data.batched_message_ids, message_ids);
+    if (!add_timer)
+        return;
+
+    timeout_add(gc, BATCH_WINDOW, [=] {
+        vector<uint64> ids;
+        ids.swap(get_data(gc).batched_message_ids);
+        for (size_t start = 0; start < ids.size(); start += MAX_BATCH_SIZE) {
+            size_t end = std::min(start + MAX_BATCH_SIZE, ids.size());
+            receive_messages(gc, vector<uint64>(ids.begin() + start, ids.begin() + end));
+        }
+        return false;
+    });
+}
+
+void receive_messages_from_items(PurpleConnection* gc, const picojson::array& items,
+                                 uint64 last_msg_id, const ReceivedCb& received_cb)
+{
+    MessagesData_ptr data{ new MessagesData() };
+    data->gc = gc;
+    data->received_cb = received_cb;
+
+    for (const picojson::value& message: items) {
+        if (field_is_present<double>(message, "id") && (uint64)json_int(message.get("id")) <= last_msg_id)
+            continue;
+        process_message(data, message);
+    }
+    download_thumbnails(data);
+}
+
 namespace
 {
 
-void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_cb)
+void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_cb,
+                         const ErrorCb& error_cb)
 {
-    CallParams params = { {"code", "return API.messages.get({\"count\": 1}).items[0].id;" } };
+    // messages.get returns either incoming or outgoing messages, so the newest messages of both
+    // are requested. Either of them is null if there are no such messages.
+    CallParams params = { {"code", "return [API.messages.get({\"count\": 1}).items[0].id, "
+                                   "API.messages.get({\"count\": 1, \"out\": 1}).items[0].id];" } };
     vk_call_api(gc, "execute", params, [=](const picojson::value& v) {
-        if (!v.is<double>()) {
+        if (!v.is<picojson::array>()) {
             vkcom_debug_error("Strange response from messages.get: %s\n",
                                v.serialize().data());
-            last_message_id_cb(0);
+            error_cb();
             return;
         }
 
-        last_message_id_cb(v.get<double>());
+        uint64 last_msg_id = 0;
+        for (const picojson::value& msg_id: v.get<picojson::array>())
+            if (msg_id.is<double>())
+                last_msg_id = std::max(last_msg_id, (uint64)json_int(msg_id));
+        last_message_id_cb(last_msg_id);
     }, [=](const picojson::value&) {
-        last_message_id_cb(0);
+        error_cb();
     });
 }
 
-void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_msg_id, bool outgoing)
+void receive_messages_range_internal(PurpleConnection* gc, uint64 last_msg_id, uint64 max_msg_id,
+                                     const ReceivedCb& received_cb)
 {
-    vkcom_debug_info("Receiving %s messages starting from %llu\n",
-                      outgoing ? "outgoing" : "incoming", (unsigned long long)last_msg_id + 1);
+    vkcom_debug_info("Receiving messages from %llu to %llu\n", (unsigned long long)last_msg_id + 1,
+                     (unsigned long long)max_msg_id);
+
+    MessagesRangeData_ptr range{ new MessagesRangeData() };
+    range->gc = gc;
+    range->received_cb = received_cb;
+    range->last_msg_id = last_msg_id;
+    range->max_msg_id = max_msg_id;
+    range->next_request_msg_id = last_msg_id + 1;
+    range->next_deliver_msg_id = last_msg_id + 1;
+    range->requesting = 0;
+    range->delivering = false;
+    range->max_delivered_msg_id = 0;
+    range->logs.reset(new PurpleLogCache(gc));
+
+    request_messages_windows(range);
+    deliver_messages_chunk(range);
+}
 
-    CallParams params = { {"out", outgoing ? "1" : "0"}, {"count", "200"},
-                          {"last_message_id", to_string(last_msg_id) } };
+void request_messages_windows(const MessagesRangeData_ptr& range)
+{
+    // Windows are requested via vk_call_api_batched, so this many windows usually cost one request.
+    const size_t MAX_UNDELIVERED_WINDOWS = 4;
 
-    vk_call_api_items(data->gc, "messages.get", params, true, [=](const picojson::value& message) {
-        process_message(data, message);
-    }, [=] {
-        vkcom_debug_info("Finished processing %s messages\n", outgoing ? "outgoing" : "incoming");
-        if (!outgoing)
-            receive_messages_range_internal(data, last_msg_id, true);
-        else
-            download_thumbnail(data, 0, 0);
+    while (range->next_request_msg_id <= range->max_msg_id
+           && range->requesting + range->windows.size() < MAX_UNDELIVERED_WINDOWS) {
+        request_messages_window(range, range->next_request_msg_id);
+        range->next_request_msg_id += MESSAGES_WINDOW_SIZE;
+    }
+}
+
+void request_messages_window(const MessagesRangeData_ptr& range, uint64 start_msg_id)
+{
+    uint64 end_msg_id = std::min(start_msg_id + MESSAGES_WINDOW_SIZE - 1, range->max_msg_id);
+    vector<uint64> message_ids;
+    for (uint64 msg_id = start_msg_id; msg_id <= end_msg_id; msg_id++)
+        message_ids.push_back(msg_id);
+    range->requesting++;
+
+    CallParams params = { {"message_ids", str_concat_int(',', message_ids)} };
+    vk_call_api_batched(range->gc, "messages.getById", params, [=](const picojson::value& result) {
+        range->requesting--;
+
+        // Deleted messages are not returned, so the window can have less messages than ids.
+        MessagesData_ptr window{ new MessagesData() };
+        window->gc = range->gc;
+        if (field_is_present<picojson::array>(result, "items")) {
+            for (const picojson::value& message: result.get("items").get<picojson::array>())
+                process_message(window, message);
+        } else {
+            vkcom_debug_error("Strange response from messages.getById: %s\n", result.serialize().data());
+        }
+        std::sort(window->messages.begin(), window->messages.end(), [](const Message& a, const Message& b) {
+            return a.mid < b.mid;
+        });
+        range->windows[start_msg_id] = std::move(window->messages);
+
+        deliver_messages_chunk(range);
+        request_messages_windows(range);
     }, [=](const picojson::value&) {
-        finish_receiving(data);
+        // Skip the window, like receive_messages does, so that the rest of messages is still delivered.
+        range->requesting--;
+        range->windows[start_msg_id] = vector<Message>();
+
+        deliver_messages_chunk(range);
+        request_messages_windows(range);
     });
 }
 
+void deliver_messages_chunk(const MessagesRangeData_ptr& range)
+{
+    if (range->delivering)
+        return;
+
+    // Windows are sorted and do not overlap, so appending them is enough to get a sorted chunk.
+    MessagesData_ptr chunk{ new MessagesData() };
+    chunk->gc = range->gc;
+    chunk->logs = range->logs;
+    while (!range->windows.empty() && range->windows.begin()->first == range->next_deliver_msg_id) {
+        vector<Message>& window = range->windows.begin()->second;
+        chunk->messages.insert(chunk->messages.end(), std::make_move_iterator(window.begin()),
+                               std::make_move_iterator(window.end()));
+        range->windows.erase(range->windows.begin());
+        range->next_deliver_msg_id += MESSAGES_WINDOW_SIZE;
+    }
+
+    if (!chunk->messages.empty()) {
+        vkcom_debug_info("Delivering %zu messages\n", chunk->messages.size());
+        range->delivering = true;
+        chunk->received_cb = [=](uint64 max_msg_id) {
+            range->max_delivered_msg_id = std::max(range->max_delivered_msg_id, max_msg_id);
+            range->delivering = false;
+            deliver_messages_chunk(range);
+            request_messages_windows(range);
+        };
+        download_thumbnails(chunk);
+        return;
+    }
+
+    if (range->next_deliver_msg_id <= range->max_msg_id)
+        return;
+
+    vkcom_debug_info("Finished receiving messages\n");
+    if (range->received_cb)
+        range->received_cb(range->max_delivered_msg_id);
+}
 
 // NOTE:
 //  * We must escape text, otherwise we cannot receive comment, containing &amp; or <br>
@@ -224,46 +422,77 @@ string timestamp_to_long_format(time_t timestamp)
     return purple_date_format_long(localtime(&timestamp));
 }
 
-void process_message(const MessagesData_ptr& data, const picojson::value& fields)
+// Fields of message object, returned by messages.get and messages.getById.
+struct MessageFields
 {
-    if (!field_is_present<double>(fields, "user_id") || !field_is_present<double>(fields, "date")
-            || !field_is_present<string>(fields, "body") || !field_is_present<double>(fields, "id")
-            || !field_is_present<double>(fields, "read_state")|| !field_is_present<double>(fields, "out")) {
-        vkcom_debug_error("Strange response from messages.get or messages.getById: %s\n",
-                           fields.serialize().data());
+    uint64 id;
+    uint64 user_id;
+    uint64 chat_id;
+    int64 date;
+    string body;
+    bool read_state;
+    bool out;
+    const picojson::array* attachments;
+    const picojson::array* fwd_messages;
+    const picojson::value* geo;
+};
+
+const JsonSchema<MessageFields> message_fields_schema = {
+    json_field("id", &MessageFields::id),
+    json_field("user_id", &MessageFields::user_id),
+    json_optional_field("chat_id", &MessageFields::chat_id),
+    json_field("date", &MessageFields::date),
+    json_field("body", &MessageFields::body),
+    json_field("read_state", &MessageFields::read_state),
+    json_field("out", &MessageFields::out),
+    json_optional_field("attachments", &MessageFields::attachments),
+    json_optional_field("fwd_messages", &MessageFields::fwd_messages),
+    json_optional_field("geo", &MessageFields::geo),
+};
+
+void process_message(const MessagesData_ptr& data, const picojson::value& v)
+{
+    VkProcessingStats& processing_stats = get_data(data->gc).processing_stats;
+    steady_time_point decode_start = steady_clock::now();
+
+    MessageFields fields = {};
+    string error;
+    if (!message_fields_schema.decode(v, fields, error)) {
+        vkcom_debug_error("Strange response from messages.get or messages.getById (%s): %s\n",
+                          error.data(), v.serialize().data());
         return;
     }
 
     Message message;
-    message.mid = fields.get("id").get<double>();
-    message.user_id = fields.get("user_id").get<double>();
-    message.chat_id = 0;
-    if (field_is_present<double>(fields, "chat_id"))
-        message.chat_id = fields.get("chat_id").get<double>();
-
-    message.text = cleanup_message_body(fields.get("body").get<string>());
-    message.timestamp = fields.get("date").get<double>();
-    if (fields.get("out").get<double>() != 0.0)
+    message.mid = fields.id;
+    message.user_id = fields.user_id;
+    message.chat_id = fields.chat_id;
+
+    message.text = cleanup_message_body(fields.body);
+    message.timestamp = fields.date;
+    if (fields.out)
         message.status = MESSAGE_OUTGOING;
-    else if (fields.get("read_state").get<double>() == 0.0)
+    else if (!fields.read_state)
         message.status = MESSAGE_INCOMING_UNREAD;
     else
         message.status = MESSAGE_INCOMING_READ;
 
     // Process attachments: append information to text.
-    if (field_is_present<picojson::array>(fields, "attachments"))
-        process_attachments(data->gc, fields.get("attachments").get<picojson::array>(), message);
+    if (fields.attachments)
+        process_attachments(data->gc, *fields.attachments, message);
 
     // Process forwarded messages.
-    if (field_is_present<picojson::array>(fields, "fwd_messages")) {
-        const picojson::array& fwd_messages = fields.get("fwd_messages").get<picojson::array>();
-        for (const picojson::value& m: fwd_messages)
+    if (fields.fwd_messages) {
+        for (const picojson::value& m: *fields.fwd_messages)
             process_fwd_message(data->gc, m, message);
     }
-    if (field_is_present<picojson::object>(fields, "geo"))
-        process_geo(fields.get("geo"), message);
+    if (fields.geo)
+        process_geo(*fields.geo, message);
 
     data->messages.push_back(std::move(message));
+
+    processing_stats.decoded_messages++;
+    processing_stats.decode_time += steady_clock::now() - decode_start;
 }
 
 void process_attachments(PurpleConnection* gc, const picojson::array& items, Message& message)
@@ -326,8 +555,8 @@ void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Me
 
     message.text += "<br>";
 
-    uint64 user_id = fields.get("user_id").get<double>();
-    string date = timestamp_to_long_format(fields.get("date").get<double>());
+    uint64 user_id = json_int(fields.get("user_id"));
+    string date = timestamp_to_long_format(json_int(fields.get("date")));
     // Placeholder either contains a formed href, if the user is already known, or will be replaced
     // with proper name and href in replace_ids().
     string text = str_format(i18n("Forwarded message (from %s on %s):\n"),
@@ -353,8 +582,8 @@ void process_photo_attachment(const picojson::value& fields, Message& message,
                            "or messages.getById: %s\n", fields.serialize().data());
         return;
     }
-    const uint64 id = fields.get("id").get<double>();
-    const int64 owner_id = fields.get("owner_id").get<double>();
+    const uint64 id = json_int(fields.get("id"));
+    const int64 owner_id = json_int(fields.get("owner_id"));
     const string& photo_text = fields.get("text").get<string>();
     const string& thumbnail = fields.get("photo_604").get<string>();
 
@@ -393,8 +622,8 @@ void process_video_attachment(const picojson::value& fields, Message& message,
                            "or messages.getById: %s\n", fields.serialize().data());
         return;
     }
-    const uint64 id = fields.get("id").get<double>();
-    const int64 owner_id = fields.get("owner_id").get<double>();
+    const uint64 id = json_int(fields.get("id"));
+    const int64 owner_id = json_int(fields.get("owner_id"));
     const string& title = fields.get("title").get<string>();
     const string& thumbnail = fields.get("photo_320").get<string>();
 
@@ -453,13 +682,13 @@ void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields
 
     message.text += "<br>";
 
-    uint64 id = fields.get("id").get<double>();
+    uint64 id = json_int(fields.get("id"));
     // This happens in case of reposts, where only "from_id" is specified.
     int64 to_id;
     if (field_is_present<double>(fields, "to_id"))
-        to_id = fields.get("to_id").get<double>();
+        to_id = json_int(fields.get("to_id"));
     else
-        to_id = fields.get("from_id").get<double>();
+        to_id = json_int(fields.get("from_id"));
 
     if (to_id > 0) {
         message.text += get_user_placeholder(gc, to_id, message);
@@ -471,7 +700,7 @@ void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields
                                  (unsigned long long)id);
     const char* verb = (fields.contains("copy_text") || fields.contains("copy_history"))
                         ? i18n("reposted") : i18n("posted");
-    string date = timestamp_to_long_format(fields.get("date").get<double>());
+    string date = timestamp_to_long_format(json_int(fields.get("date")));
 
     message.text += str_format(" <a href='%s'>%s</a> %s %s<br>", wall_url.data(), verb,
                                i18n("on"), date.data());
@@ -696,151 +925,165 @@ string get_group_placeholder(PurpleConnection* gc, uint64 group_id, Message& mes
     }
 }
 
-void download_thumbnail(const MessagesData_ptr& data, size_t msg_num, size_t thumb_num)
+void download_thumbnails(const MessagesData_ptr& data)
 {
-    if (msg_num >= data->messages.size()) {
-        replace_user_ids(data);
-        return;
+    // Thumbnails are small, so a few parallel downloads over the keepalive pool are enough
+    // to saturate the connection without opening too many sockets to Vk.com.
+    const size_t MAX_PARALLEL_DOWNLOADS = 4;
+
+    ThumbnailDownloads_ptr downloads{ new ThumbnailDownloads() };
+    downloads->data = data;
+    for (size_t msg_num = 0; msg_num < data->messages.size(); msg_num++) {
+        for (size_t thumb_num = 0; thumb_num < data->messages[msg_num].thumbnail_urls.size(); thumb_num++)
+            downloads->thumbnails.push_back({ msg_num, thumb_num });
     }
-    if (thumb_num >= data->messages[msg_num].thumbnail_urls.size()) {
-        download_thumbnail(data, msg_num + 1, 0);
+    downloads->next = 0;
+    downloads->remaining = downloads->thumbnails.size();
+
+    if (downloads->thumbnails.empty()) {
+        resolve_ids(data);
         return;
     }
 
-    const string& url = data->messages[msg_num].thumbnail_urls[thumb_num];
-    http_get(data->gc, url, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
-        if (!purple_http_response_is_successful(response)) {
-            vkcom_debug_error("Unable to download thumbnail: %s\n",
-                               purple_http_response_get_error(response));
-            download_thumbnail(data, msg_num, thumb_num + 1);
-            return;
-        }
-
-        size_t size;
-        const char* img_data = purple_http_response_get_data(response, &size);
-        int img_id = purple_imgstore_add_with_id(g_memdup(img_data, size), size, nullptr);
-
-        string img_tag = str_format("<img id=\"%d\">", img_id);
-        string img_placeholder = str_format("<thumbnail-placeholder-%zu>", thumb_num);
-        str_replace(data->messages[msg_num].text, img_placeholder, img_tag);
-
-        download_thumbnail(data, msg_num, thumb_num + 1);
-    });
+    size_t parallel = std::min(MAX_PARALLEL_DOWNLOADS, downloads->thumbnails.size());
+    for (size_t i = 0; i < parallel; i++)
+        download_next_thumbnail(downloads);
 }
 
-void replace_user_ids(const MessagesData_ptr& data)
+void download_next_thumbnail(const ThumbnailDownloads_ptr& downloads)
 {
-    // Get all user ids, which are not present in user_infos.
-    set<uint64> unknown_user_ids;
-    for (const Message& message: data->messages) {
-        insert_if(unknown_user_ids, message.unknown_user_ids, [=](uint64 user_id) {
-            return is_unknown_user(data->gc, user_id);
-        });
-    }
+    if (downloads->next >= downloads->thumbnails.size())
+        return;
 
-    update_user_infos(data->gc, unknown_user_ids, [=] {
-        for (Message& m: data->messages) {
-            for (size_t i = 0; i < m.unknown_user_ids.size(); i++) {
-                uint64 id = m.unknown_user_ids[i];
-                VkUserInfo* info = get_user_info(data->gc, id);
-                // Getting the user info could fail.
-                if (!info)
-                    continue;
-
-                string placeholder = str_format("<user-placeholder-%zu>", i);
-                string href = get_user_href(id, *info);
-                str_replace(m.text, placeholder, href);
-            }
+    size_t msg_num = downloads->thumbnails[downloads->next].first;
+    size_t thumb_num = downloads->thumbnails[downloads->next].second;
+    downloads->next++;
+
+    const MessagesData_ptr& data = downloads->data;
+    const string& url = data->messages[msg_num].thumbnail_urls[thumb_num];
+    fetch_cached_image(data->gc, url, [=](int img_id) {
+        if (img_id != 0) {
+            string img_tag = str_format("<img id=\"%d\">", img_id);
+            string img_placeholder = str_format("<thumbnail-placeholder-%zu>", thumb_num);
+            str_replace(downloads->data->messages[msg_num].text, img_placeholder, img_tag);
         }
 
-        replace_group_ids(data);
+        downloads->remaining--;
+        if (downloads->remaining == 0)
+            resolve_ids(downloads->data);
+        else
+            download_next_thumbnail(downloads);
     });
 }
 
-void replace_group_ids(const MessagesData_ptr& data)
+void resolve_ids(const MessagesData_ptr& data)
 {
-    vector<uint64> group_ids;
+    // Users to get information about: all users and groups, mentioned in messages, authors of every
+    // incoming message (we need their real names when we write to the log) and all the users to be added
+    // to the buddy list (see below). Chats to get information about: all incoming chats.
+    set<uint64> unknown_user_ids;
+    set<uint64> unknown_group_ids;
+    set<uint64> unknown_chat_ids;
     for (const Message& m: data->messages) {
-        append_if(group_ids, m.unknown_group_ids, [=](uint64 group_id) {
+        insert_if(unknown_user_ids, m.unknown_user_ids, [=](uint64 user_id) {
+            return is_unknown_user(data->gc, user_id);
+        });
+        insert_if(unknown_group_ids, m.unknown_group_ids, [=](uint64 group_id) {
             return is_unknown_group(data->gc, group_id);
         });
+        if (m.status != MESSAGE_OUTGOING && is_unknown_user(data->gc, m.user_id))
+            unknown_user_ids.insert(m.user_id);
+        if (m.status != MESSAGE_OUTGOING && m.chat_id != 0 && is_unknown_chat(data->gc, m.chat_id))
+            unknown_chat_ids.insert(m.chat_id);
     }
 
-    update_groups_info(data->gc, group_ids, [=] {
+    // Called once all three updates below have finished.
+    shared_ptr<int> updates_running{ new int(3) };
+    SuccessCb updated_cb = [=] {
+        (*updates_running)--;
+        if (*updates_running > 0)
+            return;
+
+        // Chats to be added to buddy list: all unread incoming chats. Users to be added to buddy list:
+        // authors of unread non-chat messages. Chat participants are never added to buddy list (unless
+        // they are already there).
+        set<uint64> chat_ids_to_buddy_list;
+        set<uint64> user_ids_to_buddy_list;
         for (Message& m: data->messages) {
-            for (size_t i = 0; i < m.unknown_group_ids.size(); i++) {
-                uint64 group_id = m.unknown_group_ids[i];
-                VkGroupInfo* info = get_group_info(data->gc, group_id);
-                // Getting the group info could fail.
-                if (!info)
-                    continue;
-
-                string placeholder = str_format("<group-placeholder-%zu>", i);
-                string href = get_group_href(group_id, *info);
-                str_replace(m.text, placeholder, href);
-            }
+            replace_placeholders(data->gc, m);
+
+            if (m.status != MESSAGE_INCOMING_UNREAD)
+                continue;
+            if (m.chat_id != 0 && !chat_in_buddy_list(data->gc, m.chat_id))
+                chat_ids_to_buddy_list.insert(m.chat_id);
+            if (m.chat_id == 0 && !user_in_buddy_list(data->gc, m.user_id))
+                user_ids_to_buddy_list.insert(m.user_id);
         }
 
-        add_unknown_users_chats(data);
-    });
+        // All the infos are known by now, so these do not make any calls unless some update has failed.
+        add_chats_if_needed(data->gc, chat_ids_to_buddy_list, [=] {
+            add_buddies_if_needed(data->gc, user_ids_to_buddy_list, [=] {
+                finish_receiving(data);
+            });
+        });
+    };
+
+    update_user_infos(data->gc, unknown_user_ids, updated_cb);
+    update_groups_info(data->gc, vector<uint64>(unknown_group_ids.begin(), unknown_group_ids.end()),
+                       updated_cb);
+    update_chat_infos(data->gc, unknown_chat_ids, updated_cb);
 }
 
-void add_unknown_users_chats(const MessagesData_ptr& data)
+void replace_placeholders(PurpleConnection* gc, Message& message)
 {
-    // Chats to get information about: all incoming chats. Chat participants are updated
-    // when updating chat information.
-    set<uint64> unknown_chat_ids;
-    for (const Message& m: data->messages)
-        if (m.status != MESSAGE_OUTGOING && m.chat_id != 0 && is_unknown_chat(data->gc, m.chat_id))
-            unknown_chat_ids.insert(m.chat_id);
+    for (size_t i = 0; i < message.unknown_user_ids.size(); i++) {
+        uint64 user_id = message.unknown_user_ids[i];
+        VkUserInfo* info = get_user_info(gc, user_id);
+        // Getting the user info could fail.
+        if (!info)
+            continue;
 
-    update_chat_infos(data->gc, unknown_chat_ids, [=] {
-        // Chats to be added to buddy list: all unread incoming chats.
-        set<uint64> chat_ids_to_buddy_list;
-        for (const Message& m: data->messages)
-            if (m.status == MESSAGE_INCOMING_UNREAD && m.chat_id != 0 && !chat_in_buddy_list(data->gc, m.chat_id))
-                chat_ids_to_buddy_list.insert(m.chat_id);
+        string placeholder = str_format("<user-placeholder-%zu>", i);
+        string href = get_user_href(user_id, *info);
+        str_replace(message.text, placeholder, href);
+    }
 
-        add_chats_if_needed(data->gc, chat_ids_to_buddy_list, [=] {
-            // Users to get information about: authors of every read incoming message (we need their real
-            // names when we write to the log) and all the users to be added to the buddy list (see below).
-            // Not all chat participants have been updated when chat information was updated due to chats
-            // being deactivated, so let's update info for them.
-            set<uint64> unknown_user_ids;
-            for (const Message& m: data->messages)
-                if (m.status != MESSAGE_OUTGOING && is_unknown_user(data->gc, m.user_id))
-                    unknown_user_ids.insert(m.user_id);
-
-            update_user_infos(data->gc, unknown_user_ids, [=] {
-                // Users to be added to buddy list: authors of unread non-chat messages. Chat participants
-                // are never added to buddy list (unless they are already there).
-                set<uint64> user_ids_to_buddy_list;
-                for (const Message& m: data->messages)
-                    if (m.status == MESSAGE_INCOMING_UNREAD && m.chat_id == 0 && !user_in_buddy_list(data->gc, m.user_id))
-                        user_ids_to_buddy_list.insert(m.user_id);
-
-                add_buddies_if_needed(data->gc, user_ids_to_buddy_list, [=] {
-                    finish_receiving(data);
-                });
-            });
-        });
-    });
+    for (size_t i = 0; i < message.unknown_group_ids.size(); i++) {
+        uint64 group_id = message.unknown_group_ids[i];
+        VkGroupInfo* info = get_group_info(gc, group_id);
+        // Getting the group info could fail.
+        if (!info)
+            continue;
+
+        string placeholder = str_format("<group-placeholder-%zu>", i);
+        string href = get_group_href(group_id, *info);
+        str_replace(message.text, placeholder, href);
+    }
 }
 
 void finish_receiving(const MessagesData_ptr& data)
 {
-    std::sort(data->messages.begin(), data->messages.end(), [](const Message& a, const Message& b) {
-        return a.mid < b.mid;
-    });
+    // Chunks from receive_messages_range are already sorted without duplicates
+    // (see deliver_messages_chunk), messages from other sources must be sorted.
+    bool sorted = std::adjacent_find(data->messages.begin(), data->messages.end(),
+                                     [](const Message& a, const Message& b) {
+        return a.mid >= b.mid;
+    }) == data->messages.end();
+    if (!sorted) {
+        std::sort(data->messages.begin(), data->messages.end(), [](const Message& a, const Message& b) {
+            return a.mid < b.mid;
+        });
 
-    // We could've received duplicate messages if a new message arrived between asking for
-    // two message batches (with two different offsets). In this case batches overlap (offset
-    // starts counting from other base).
-    unique(data->messages, [](const Message& a, const Message& b) {
-        return a.mid == b.mid;
-    });
+        // The same id could have been added twice to receive_messages_batched.
+        unique(data->messages, [](const Message& a, const Message& b) {
+            return a.mid == b.mid;
+        });
+    }
 
-    PurpleLogCache logs(data->gc);
+    VkProcessingStats& processing_stats = get_data(data->gc).processing_stats;
+    steady_time_point write_start = steady_clock::now();
+    if (!data->logs)
+        data->logs.reset(new PurpleLogCache(data->gc));
     for (const Message& m: data->messages) {
         if (m.status == MESSAGE_INCOMING_UNREAD) {
             // Open new conversation for received message.
@@ -889,13 +1132,15 @@ void finish_receiving(const MessagesData_ptr& data)
             } else {
                 PurpleLog* log;
                 if (m.chat_id == 0)
-                    log = logs.for_user(m.user_id);
+                    log = data->logs->for_user(m.user_id);
                 else
-                    log = logs.for_chat(m.chat_id);
+                    log = data->logs->for_chat(m.chat_id);
                 purple_log_write(log, flags, from.data(), m.timestamp, m.text.data());
             }
         }
     }
+    processing_stats.written_messages += data->messages.size();
+    processing_stats.write_time += steady_clock::now() - write_start;
 
     // Mark incoming messages as read.
     vector<VkReceivedMessage> unread_messages;
@@ -977,7 +1222,7 @@ void mark_messages_as_read_impl(PurpleConnection* gc, const Cont& message_ids)
 
     vkcom_debug_info("Marking %d messages as read\n", (int)message_ids.size());
     CallParams params = { {"message_ids", str_concat_int(',', message_ids)} };
-    vk_call_api(gc, "messages.markAsRead", params, nullptr, nullptr);
+    vk_call_api_batched(gc, "messages.markAsRead", params, nullptr, nullptr);
 }
 
 } // namespace
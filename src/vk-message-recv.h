@@ -12,12 +12,24 @@ typedef function_ptr<void(uint64 max_msg_id)> ReceivedCb;
 
 // Receives all messages starting after from_msg_id. If last_msg_id is zero only unread incoming messages
 // are received, otherwise all messages (both sent and received) since last_msg_id are received, not including
-// last_msg_id.
-void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb);
+// last_msg_id. error_cb is called if the id of the newest message cannot be received, no messages
+// are received in this case.
+void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb,
+                            const ErrorCb& error_cb);
 
 // Receives messages with given ids. Suitable for small amount of message_ids (< 100).
 void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids);
 
+// Same as receive_messages, but the messages are received after a short delay along with all other
+// messages, requested during that time, in one messages.getById call.
+void receive_messages_batched(PurpleConnection* gc, const vector<uint64>& message_ids);
+
+// Receives messages, which have already been returned by some API call (e.g. "messages" in
+// messages.getLongPollHistory), without requesting them again. Messages with ids less or equal
+// to last_msg_id have already been processed and are skipped.
+void receive_messages_from_items(PurpleConnection* gc, const picojson::array& items,
+                                 uint64 last_msg_id, const ReceivedCb& received_cb);
+
 // Marks messages as read or defers marking them until it is appropriate to mark them as read.
 void mark_message_as_read(PurpleConnection* gc, const vector<VkReceivedMessage>& messages);
 
@@ -164,8 +164,8 @@ void upload_imgstore_images_impl(PurpleConnection* gc, const UploadImgstoreImage
             images->attachments += ',';
         // NOTE: We do not receive "access_key" from photos.saveMessagesPhoto, but it seems it does not matter,
         // vk.com will automatically add access_key to your private photos.
-        int64 owner_id = (int64)fields.get("owner_id").get<double>();
-        uint64 id = (uint64)fields.get("id").get<double>();
+        int64 owner_id = json_int(fields.get("owner_id"));
+        uint64 id = json_int(fields.get("id"));
         images->attachments += str_format("photo%lld_%llu", (long long)owner_id,
                                           (unsigned long long)id);
 
@@ -285,7 +285,7 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
 
         // NOTE: We do not set last_msg_id here, because it is done when corresponding notification is received
         // in longpoll.
-        uint64 msg_id = v.get<double>();
+        uint64 msg_id = json_int(v);
         get_data(gc).add_sent_msg_id(msg_id);
 
         // Check if we have sent the whole message.
@@ -315,7 +315,7 @@ void process_im_error(const picojson::value& error, PurpleConnection* gc, const
         show_error(gc, *message);
         return;
     }
-    int error_code = error.get("error_code").get<double>();
+    int error_code = json_int(error.get("error_code"));
     if (error_code != VK_CAPTCHA_NEEDED) {
         show_error(gc, *message);
         return;
@@ -1,3 +1,5 @@
+#include <gio/gio.h>
+
 #include <accountopt.h>
 #include <cmds.h>
 #include <prpl.h>
@@ -12,6 +14,7 @@
 #include "vk-chat.h"
 #include "vk-common.h"
 #include "vk-filexfer.h"
+#include "vk-image-cache.h"
 #include "vk-longpoll.h"
 #include "vk-message-recv.h"
 #include "vk-message-send.h"
@@ -127,6 +130,25 @@ void conversation_updated(PurpleConversation* conv, PurpleConvUpdateType type, g
     }
 }
 
+// Signal handler for network-changed signal of GNetworkMonitor. Long Poll is suspended while
+// the network is unavailable (see retry_long_poll) and gets resumed here.
+void network_changed(GNetworkMonitor*, gboolean network_available, gpointer data)
+{
+    PurpleConnection* gc = (PurpleConnection*)data;
+    VkData& gc_data = get_data(gc);
+    if (bool(network_available) == gc_data.network_available)
+        return;
+
+    gc_data.network_available = network_available;
+    if (network_available) {
+        vkcom_debug_info("Network is available\n");
+        resume_long_poll(gc);
+    } else {
+        vkcom_debug_info("Network is unavailable\n");
+        gc_data.network_down_count++;
+    }
+}
+
 void conversation_received_msg(PurpleAccount* /*account*/, const char* /*who*/, const char* message,
                                   PurpleConversation* conv, PurpleMessageFlags /*flags*/,
                                   gpointer data)
@@ -229,6 +251,19 @@ PurpleCmdRet cmd_chat_remove(PurpleConversation *conv, const char*, char** args,
     return PURPLE_CMD_RET_OK;
 }
 
+PurpleCmdRet cmd_vkstats(PurpleConversation *conv, const char*, char**, char**, void*)
+{
+    PurpleConnection* gc = purple_account_get_connection(purple_conversation_get_account(conv));
+    char* escaped = purple_markup_escape_text(vk_call_stats_to_string(gc).data(), -1);
+    string text = escaped;
+    g_free(escaped);
+    str_replace(text, "\n", "<br>");
+    purple_conversation_write(conv, nullptr, text.data(),
+                              PurpleMessageFlags(PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG),
+                              time(nullptr));
+    return PURPLE_CMD_RET_OK;
+}
+
 // Registers slash-commands for chats (/title and others).
 void register_chat_cmds()
 {
@@ -244,6 +279,11 @@ void register_chat_cmds()
                         PurpleCmdFlag(PURPLE_CMD_FLAG_CHAT | PURPLE_CMD_FLAG_PRPL_ONLY),
                         "prpl-vkcom", cmd_chat_remove,
                         i18n("remove &lt;user&gt;: Remove user from chat"), nullptr);
+    purple_cmd_register("vkstats", "", PURPLE_CMD_P_PRPL,
+                        PurpleCmdFlag(PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT
+                                      | PURPLE_CMD_FLAG_PRPL_ONLY),
+                        "prpl-vkcom", cmd_vkstats,
+                        i18n("vkstats: Show statistics on Vk.com API calls"), nullptr);
 }
 
 void vk_set_status_impl(PurpleConnection* gc, PurpleStatus* status)
@@ -287,6 +327,11 @@ void vk_login(PurpleAccount* account)
         // Remember current aliases and groups of buddies and chats to check whether user has modified them later.
         check_blist_on_login(gc);
 
+        // Track network availability to pause Long Poll and periodic updates while offline.
+        GNetworkMonitor* network_monitor = g_network_monitor_get_default();
+        get_data(gc).network_available = g_network_monitor_get_network_available(network_monitor);
+        g_signal_connect(network_monitor, "network-changed", G_CALLBACK(network_changed), gc);
+
         // Start Long Poll event processing. Buddy list and unread messages will be retrieved there.
         start_long_poll(gc);
 
@@ -294,14 +339,16 @@ void vk_login(PurpleAccount* account)
         // updates to buddy status text, buddy icon or other information. First time user and chat infos are
         // updated when longpoll starts.
         timeout_add(gc, 15 * 60 * 1000, [=] {
-            update_user_chat_infos(gc);
+            if (get_data(gc).network_available)
+                update_user_chat_infos(gc);
             return true;
         });
 
         // Longpoll only notifies about status of friends. If we have conversations open with non-friends,
         // we update their status every minute.
         timeout_add(gc, 60 * 1000, [=] {
-            update_open_conv_presence(gc);
+            if (get_data(gc).network_available)
+                update_open_conv_presence(gc);
             return true;
         });
 
@@ -310,7 +357,14 @@ void vk_login(PurpleAccount* account)
         vk_set_status_impl(gc, status);
         // Update that we are online every 15 minutes.
         timeout_add(gc, 15 * 60 * 1000, [=] {
-            update_status(gc);
+            if (get_data(gc).network_available)
+                update_status(gc);
+            return true;
+        });
+
+        // Dump API call statistics to the debug log every hour.
+        timeout_add(gc, 60 * 60 * 1000, [=] {
+            vkcom_debug_info("API call statistics:\n%s", vk_call_stats_to_string(gc).data());
             return true;
         });
 
@@ -334,12 +388,15 @@ void vk_close(PurpleConnection* gc)
                           PURPLE_CALLBACK(conversation_received_msg));
     purple_signal_disconnect(purple_conversations_get_handle(), "received-chat-msg", gc,
                           PURPLE_CALLBACK(conversation_received_msg));
+    g_signal_handlers_disconnect_by_func(g_network_monitor_get_default(), (gpointer)network_changed, gc);
 
     set_offline(gc);
     // Let's sleep 250 msec, so that setOffline executes successfully. Yes, it is ugly, but
     // we cannot defer destruction of PurpleConnection and doing the "right way" is such a bother.
     g_usleep(250000);
 
+    flush_long_poll_state(gc);
+
     VkData& data = get_data(gc);
     data.set_closing();
 
@@ -409,16 +466,10 @@ void vk_get_info(PurpleConnection* gc, const char* who)
         return;
     }
 
-    http_get(gc, user_info->photo_max,
-    [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
-        if (purple_http_response_is_successful(response)) {
-            size_t size;
-            const char* data = purple_http_response_get_data(response, &size);
-            int img_id = purple_imgstore_add_with_id(g_memdup(data, size), size, nullptr);
-            if (img_id != 0) {
-                string img = str_format("<img id='%d'>", img_id);
-                purple_notify_user_info_add_pair(info, nullptr, img.data());
-            }
+    fetch_cached_image(gc, user_info->photo_max, [=](int img_id) {
+        if (img_id != 0) {
+            string img = str_format("<img id='%d'>", img_id);
+            purple_notify_user_info_add_pair(info, nullptr, img.data());
         }
 
         purple_notify_user_info_add_section_break(info);
@@ -32,7 +32,7 @@ void update_status(PurpleConnection* gc)
 
 void set_online(PurpleConnection* gc)
 {
-    vk_call_api(gc, "account.setOnline", CallParams(), nullptr, nullptr);
+    vk_call_api_batched(gc, "account.setOnline", CallParams(), nullptr, nullptr);
 }
 
 void set_offline(PurpleConnection* gc)
@@ -44,5 +44,5 @@ void set_offline(PurpleConnection* gc)
 void set_status_text(PurpleConnection* gc, const char* text)
 {
     CallParams params = { { "text", text } };
-    vk_call_api(gc, "status.set", params, nullptr, nullptr);
+    vk_call_api_batched(gc, "status.set", params, nullptr, nullptr);
 }
@@ -2,6 +2,7 @@
 #include <random>
 
 #include "httputils.h"
+#include "json-schema.h"
 #include "miscutils.h"
 #include "vk-api.h"
 
@@ -16,6 +17,20 @@ void upload_file(PurpleConnection* gc, const char* get_upload_server, const char
                  const void* contents, size_t size, const UploadedCb& uploaded_cb, const ErrorCb& error_cb,
                  const UploadProgressCb& upload_progress_cb = nullptr);
 
+// Fields of the response from the photo upload server.
+struct UploadedPhotoFields
+{
+    picojson::value server;
+    string photo;
+    string hash;
+};
+
+const JsonSchema<UploadedPhotoFields> uploaded_photo_schema = {
+    json_field("server", &UploadedPhotoFields::server),
+    json_field("photo", &UploadedPhotoFields::photo),
+    json_field("hash", &UploadedPhotoFields::hash),
+};
+
 } // End of anonymous namespace
 
 void upload_doc_for_im(PurpleConnection* gc, const char* name, const void* contents, size_t size,
@@ -50,17 +65,19 @@ void upload_photo_for_im(PurpleConnection* gc, const char* name, const void* con
     vkcom_debug_info("Uploading photo for IM\n");
 
     upload_file(gc, "photos.getMessagesUploadServer", "photo", name, contents, size, [=](const picojson::value& v) {
-        if (!(field_is_present<int>(v, "server") || field_is_present<string>(v, "server"))
-            || !field_is_present<string>(v, "photo") || !field_is_present<string>(v, "hash")) {
-            vkcom_debug_error("Strange response from upload server: %s\n", v.serialize().data());
+        UploadedPhotoFields fields;
+        string error;
+        if (!uploaded_photo_schema.decode(v, fields, error)) {
+            vkcom_debug_error("Strange response from upload server (%s): %s\n", error.data(),
+                              v.serialize().data());
             if (error_cb)
                 error_cb();
             return;
         }
 
-        const string& server = v.get("server").to_str();
-        const string& photo = v.get("photo").get<string>();
-        const string& hash = v.get("hash").get<string>();
+        const string& server = fields.server.to_str();
+        const string& photo = fields.photo;
+        const string& hash = fields.hash;
         CallParams params = { {"server", server}, {"photo", photo}, {"hash", hash} };
         vk_call_api(gc, "photos.saveMessagesPhoto", params, [=](const picojson::value& result) {
             uploaded_cb(result);
@@ -12,7 +12,7 @@ void set_account_alias(PurpleConnection* gc)
     vkcom_debug_info("Getting full name for %llu\n", (unsigned long long)user_id);
 
     CallParams params = { {"user_ids", to_string(user_id)}, {"fields", "first_name,last_name"} };
-    vk_call_api(gc, "users.get", params, [=](const picojson::value& result) {
+    vk_call_api_batched(gc, "users.get", params, [=](const picojson::value& result) {
         if (!result.is<picojson::array>()) {
             vkcom_debug_error("Wrong type returned as users.get call result: %s\n",
                                result.serialize().data());
@@ -330,7 +330,7 @@ void update_groups_info(PurpleConnection* gc, vector<uint64> group_ids, const Su
     vkcom_debug_info("Getting infos for groups %s\n", group_ids_str.data());
 
     CallParams params = { {"group_ids", str_concat_int(',', group_ids)} };
-    vk_call_api(gc, "groups.getById", params, [=](const picojson::value& result) {
+    vk_call_api_batched(gc, "groups.getById", params, [=](const picojson::value& result) {
         if (!result.is<picojson::array>()) {
             vkcom_debug_error("Wrong type returned as users.get call result: %s\n",
                                result.serialize().data());
@@ -346,7 +346,7 @@ void update_groups_info(PurpleConnection* gc, vector<uint64> group_ids, const Su
                 return;
             }
 
-            uint64 id = v.get("id").get<double>();
+            uint64 id = json_int(v.get("id"));
             VkGroupInfo& info = get_data(gc).group_infos[id];
             info.name = v.get("name").get<string>();
             info.type = v.get("type").get<string>();
@@ -416,7 +416,7 @@ void resolve_screen_name(PurpleConnection* gc, const char* screen_name, const Re
             return;
         }
 
-        resolved_cb(result.get("type").get<string>(), result.get("object_id").get<double>());
+        resolved_cb(result.get("type").get<string>(), json_int(result.get("object_id")));
     }, [=](const picojson::value&) {
         resolved_cb("", 0);
     });